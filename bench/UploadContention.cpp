@@ -0,0 +1,88 @@
+// Micro-benchmark for upload slot reservation on a seeder-heavy swarm.
+//
+// Every thread plays a group of downloaders that all want chunks from the same seeder,
+// as happens early in a run when the seed is the only one with anything to give.
+// Each round, the seeder gets a fresh batch of upload credit and the threads race to reserve it.
+// We compare the old scheme (a mutex around an int) with UploadCredit.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "UploadCredit.hpp"
+
+using namespace std;
+
+namespace {
+
+/// The old way: a mutex guarding the remaining count
+class LockedCredit {
+public:
+	LockedCredit() : mutex(), remaining(0) { }
+
+	void reset(int credit) { remaining = credit; }
+
+	bool reserve()
+	{
+		lock_guard<std::mutex> lock(mutex);
+		if (remaining == 0)
+			return false;
+		--remaining;
+		return true;
+	}
+
+private:
+	std::mutex mutex;
+	int remaining;
+};
+
+/// Runs _rounds_ rounds of _threads_ threads reserving credit until it runs out.
+/// Returns nanoseconds per reservation attempt.
+template <typename Credit>
+double run(size_t threads, int rounds, int creditPerRound)
+{
+	Credit credit;
+	size_t attempts = 0;
+
+	const auto start = chrono::steady_clock::now();
+
+	for (int r = 0; r < rounds; ++r) {
+		credit.reset(creditPerRound);
+
+		vector<thread> workers;
+		vector<size_t> tries(threads);
+		for (size_t t = 0; t < threads; ++t) {
+			workers.emplace_back([&credit, &tries, t] {
+				// Keep asking until the seeder turns us down,
+				// just like acceptOffers working down its offer list
+				while (credit.reserve())
+					++tries[t];
+				++tries[t];
+			});
+		}
+		for (auto& w : workers)
+			w.join();
+		for (size_t n : tries)
+			attempts += n;
+	}
+
+	const auto elapsed = chrono::steady_clock::now() - start;
+	return chrono::duration<double, nano>(elapsed).count() / attempts;
+}
+
+} // end anonymous namespace
+
+int main(int argc, char** argv)
+{
+	const size_t threads = argc > 1 ? atoi(argv[1]) : max(2u, thread::hardware_concurrency());
+	const int rounds = 200;
+	const int creditPerRound = 200000;
+
+	printf("%zu threads, %d rounds of %d upload slots\n", threads, rounds, creditPerRound);
+	printf("mutex:         %6.1f ns/reservation\n", run<LockedCredit>(threads, rounds, creditPerRound));
+	printf("UploadCredit:  %6.1f ns/reservation\n", run<UploadCredit>(threads, rounds, creditPerRound));
+	return 0;
+}
@@ -0,0 +1,175 @@
+#include "ChunkSet.hpp"
+
+#include <algorithm>
+
+// The vector kernels are compiled for their instruction sets with target attributes,
+// whatever the rest of the build targets, and only called if the CPU supports them.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CHUNKSET_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+const size_t ChunkSet::bitsPerWord;
+
+namespace {
+
+size_t wordsFor(size_t bits) { return (bits + ChunkSet::bitsPerWord - 1) / ChunkSet::bitsPerWord; }
+
+typedef ChunkSet::Word Word;
+
+/// Returns true if any word of _a_ has a bit that the same word of _b_ doesn't, starting at word _i_
+bool andNotAnyScalar(const Word* a, const Word* b, size_t i, size_t n)
+{
+	for (; i < n; ++i) {
+		if (a[i] & ~b[i])
+			return true;
+	}
+	return false;
+}
+
+#ifdef CHUNKSET_X86_KERNELS
+
+__attribute__((target("sse2")))
+bool andNotAnySSE2(const Word* a, const Word* b, size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2) {
+		const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+		const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+		const __m128i diff = _mm_andnot_si128(vb, va);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, zero)) != 0xFFFF)
+			return true;
+	}
+	return andNotAnyScalar(a, b, i, n);
+}
+
+__attribute__((target("avx2")))
+bool andNotAnyAVX2(const Word* a, const Word* b, size_t n)
+{
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+		const __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+		// testc(b, a) is true if (~b & a) == 0
+		if (!_mm256_testc_si256(vb, va))
+			return true;
+	}
+	return andNotAnyScalar(a, b, i, n);
+}
+
+#endif
+
+ChunkSet::Kernel detectFastestKernel()
+{
+#ifdef CHUNKSET_X86_KERNELS
+	// We run before main, so make sure the CPU has been looked at
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return ChunkSet::Kernel::avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return ChunkSet::Kernel::sse2;
+#endif
+	return ChunkSet::Kernel::scalar;
+}
+
+const ChunkSet::Kernel fastest = detectFastestKernel();
+
+} // end anonymous namespace
+
+ChunkSet::ChunkSet(size_t numChunks, bool value) :
+	numChunks(numChunks),
+	words(wordsFor(numChunks), value ? ~Word(0) : Word(0))
+{
+	clearTail();
+}
+
+ChunkSet::ChunkSet(std::initializer_list<bool> bits) :
+	numChunks(bits.size()),
+	words(wordsFor(bits.size()))
+{
+	size_t i = 0;
+	for (bool b : bits) {
+		if (b)
+			set(i);
+		++i;
+	}
+}
+
+void ChunkSet::fill(bool value)
+{
+	std::fill(begin(words), end(words), value ? ~Word(0) : Word(0));
+	clearTail();
+}
+
+size_t ChunkSet::count() const
+{
+	// This is the hardware instruction when built with -mpopcnt, which the Makefile leaves off
+	// so that builds run anywhere.
+	size_t ret = 0;
+	for (Word w : words)
+		ret += __builtin_popcountll(w);
+	return ret;
+}
+
+bool ChunkSet::all() const
+{
+	return count() == numChunks;
+}
+
+bool ChunkSet::none() const
+{
+	return all_of(begin(words), end(words), [](Word w) { return w == 0; });
+}
+
+ChunkSet::Kernel ChunkSet::fastestKernel()
+{
+	return fastest;
+}
+
+bool ChunkSet::andNotAny(const ChunkSet& other) const
+{
+	return andNotAny(other, fastest);
+}
+
+bool ChunkSet::andNotAny(const ChunkSet& other, Kernel kernel) const
+{
+	assert(numChunks == other.numChunks);
+	assert(kernel <= fastest);
+
+	const Word* a = words.data();
+	const Word* b = other.words.data();
+	const size_t n = words.size();
+
+	switch (kernel) {
+#ifdef CHUNKSET_X86_KERNELS
+		case Kernel::avx2:
+			return andNotAnyAVX2(a, b, n);
+
+		case Kernel::sse2:
+			return andNotAnySSE2(a, b, n);
+#endif
+
+		default:
+			return andNotAnyScalar(a, b, 0, n);
+	}
+}
+
+size_t ChunkSet::andNotCount(const ChunkSet& other) const
+{
+	assert(numChunks == other.numChunks);
+
+	size_t ret = 0;
+	for (size_t i = 0; i < words.size(); ++i)
+		ret += __builtin_popcountll(words[i] & ~other.words[i]);
+	return ret;
+}
+
+void ChunkSet::clearTail()
+{
+	const size_t used = numChunks % bitsPerWord;
+	if (used != 0)
+		words.back() &= (Word(1) << used) - 1;
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+
+/**
+ * \brief A fixed-size set of chunk indices, packed into 64-bit words
+ *
+ * This replaces the `std::vector<bool>` peers used to track which chunks they have.
+ * `std::vector<bool>` only lets us look at one (proxy) bit at a time,
+ * which made questions like "do I have anything you don't?" a per-chunk loop.
+ * Here we keep the words ourselves so those questions can be answered a word
+ * (or, with AVX2/SSE2, a vector register) at a time.
+ * Which vector instructions to use is decided when the program starts (see Kernel),
+ * so one binary runs on any x86 machine and still uses AVX2 where it has it.
+ *
+ * Bits past size() in the last word are always kept zero,
+ * so the whole-word operations never need to mask them off.
+ */
+class ChunkSet {
+public:
+
+	typedef uint64_t Word;
+
+	static const size_t bitsPerWord = 64;
+
+	/// The ways andNotAny() can compare sets, from slowest to fastest
+	enum class Kernel {
+		scalar, ///< A word at a time
+		sse2, ///< Two words at a time (x86 only)
+		avx2 ///< Four words at a time (x86 with AVX2 only)
+	};
+
+	/// The fastest kernel this machine supports, which andNotAny() uses
+	static Kernel fastestKernel();
+
+	ChunkSet() : numChunks(0), words() { }
+
+	/// Creates a set of _numChunks_ chunks, all of which are set to _value_
+	explicit ChunkSet(size_t numChunks, bool value = false);
+
+	/// Creates a set from a list of bools, mostly for convenience in tests
+	ChunkSet(std::initializer_list<bool> bits);
+
+	/// The number of chunks in the torrent (not the number we have - see count())
+	size_t size() const { return numChunks; }
+
+	bool operator[](size_t idx) const { return test(idx); }
+
+	bool test(size_t idx) const
+	{
+		assert(idx < numChunks);
+		return (words[idx / bitsPerWord] >> (idx % bitsPerWord)) & 1;
+	}
+
+	void set(size_t idx)
+	{
+		assert(idx < numChunks);
+		words[idx / bitsPerWord] |= Word(1) << (idx % bitsPerWord);
+	}
+
+	void reset(size_t idx)
+	{
+		assert(idx < numChunks);
+		words[idx / bitsPerWord] &= ~(Word(1) << (idx % bitsPerWord));
+	}
+
+	/// Sets or clears every chunk in the set
+	void fill(bool value);
+
+	/// Returns the number of chunks in the set
+	size_t count() const;
+
+	/// Returns true if every chunk is in the set
+	bool all() const;
+
+	/// Returns true if no chunk is in the set
+	bool none() const;
+
+	/**
+	 * \brief Returns true if there is any chunk in this set that is not in _other_
+	 *
+	 * i.e. `(*this & ~other) != 0`. This is the "do I have anything for you?" question.
+	 */
+	bool andNotAny(const ChunkSet& other) const;
+
+	/// andNotAny(), using the given kernel, which this machine must support (see fastestKernel()).
+	/// This lets tests check each kernel against the others.
+	bool andNotAny(const ChunkSet& other, Kernel kernel) const;
+
+	/// Returns the number of chunks in this set that are not in _other_ ("how much do I have for you?")
+	size_t andNotCount(const ChunkSet& other) const;
+
+	/// Calls _f_ with the index of each chunk in the set, in ascending order
+	template <typename F>
+	void forEachSet(F f) const
+	{
+		for (size_t w = 0; w < words.size(); ++w) {
+			for (Word bits = words[w]; bits != 0; bits &= bits - 1)
+				f(w * bitsPerWord + __builtin_ctzll(bits));
+		}
+	}
+
+	bool operator==(const ChunkSet& o) const { return numChunks == o.numChunks && words == o.words; }
+
+	bool operator!=(const ChunkSet& o) const { return !operator==(o); }
+
+private:
+
+	/// Clears the unused bits past numChunks in the last word
+	void clearTail();
+
+	size_t numChunks; ///< The number of chunks (bits) in the set
+	std::vector<Word> words; ///< The bits themselves
+};
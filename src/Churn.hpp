@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <random>
+
+/**
+ * \brief Decides how long peers stay away and how long they stay connected
+ *
+ * Rather than asking every peer each tick if it's joining or leaving,
+ * the simulator asks us how long until a peer's next change when it makes its last one,
+ * then schedules that change in a TimerWheel.
+ *
+ * Times come from one of several distributions, each with a mean of about 1 / p ticks,
+ * where _p_ is the join or leave probability:
+ *
+ * - geometric: exactly what you get by flipping a coin with probability _p_ every tick.
+ * - exponential: the continuous version of the same thing.
+ * - Weibull: _shape_ below 1 gives many short stays and a few very long ones,
+ *   which is what measurements of real swarms tend to find. A shape of 1 is exponential.
+ * - Pareto: even heavier tails than Weibull. _shape_ (the tail index) must be above 1 for the mean to exist.
+ */
+class ChurnModel {
+public:
+
+	enum class Distribution {
+		geometric,
+		exponential,
+		weibull,
+		pareto
+	};
+
+	/**
+	 * \param dist The distribution times come from
+	 * \param joinProbability The chance a disconnected peer would reconnect on a given tick
+	 * \param leaveProbability The chance a connected peer would leave on a given tick.
+	 *                         Zero means peers never leave.
+	 * \param shape The shape parameter for the Weibull and Pareto distributions (ignored otherwise)
+	 */
+	ChurnModel(Distribution dist, double joinProbability, double leaveProbability, double shape) :
+		dist(dist), joinProbability(joinProbability), leaveProbability(leaveProbability), shape(shape)
+	{ }
+
+	/// Returns true if peers ever leave
+	bool peersLeave() const { return leaveProbability > 0; }
+
+	/// How many ticks a peer that just disconnected (or was just created) stays away. At least 1.
+	template <typename RNG>
+	uint64_t timeAway(RNG& gen) const
+	{
+		// A peer can't come back the tick it left, so the soonest is the next one
+		return 1 + draw(joinProbability, gen);
+	}
+
+	/// How many ticks a peer that just connected stays. Zero means it leaves at the end of the tick.
+	template <typename RNG>
+	uint64_t timeConnected(RNG& gen) const
+	{
+		return draw(leaveProbability, gen);
+	}
+
+private:
+
+	/// Draws how many ticks go by before an event that happens with probability _p_ each tick
+	template <typename RNG>
+	uint64_t draw(double p, RNG& gen) const
+	{
+		if (p >= 1)
+			return 0;
+
+		const double mean = 1 / p;
+		double ticks = 0;
+		switch (dist) {
+			case Distribution::geometric:
+				return std::geometric_distribution<uint64_t>(p)(gen);
+
+			case Distribution::exponential:
+				ticks = std::exponential_distribution<double>(p)(gen);
+				break;
+
+			case Distribution::weibull:
+				// Pick the scale that gives us the mean we want
+				ticks = std::weibull_distribution<double>(shape, mean / std::tgamma(1 + 1 / shape))(gen);
+				break;
+
+			case Distribution::pareto: {
+				// Inverse transform sampling, with the minimum picked to give us the mean we want
+				const double minimum = mean * (shape - 1) / shape;
+				const double u = std::uniform_real_distribution<double>()(gen);
+				ticks = minimum / std::pow(1 - u, 1 / shape);
+				break;
+			}
+		}
+
+		// Round down so that these line up with the geometric distribution, which counts the ticks
+		// *before* the event. Clamp so that the heavy tails can't overflow.
+		return ticks < 1e18 ? (uint64_t)ticks : (uint64_t)1e18;
+	}
+
+	Distribution dist;
+	double joinProbability;
+	double leaveProbability;
+	double shape;
+};
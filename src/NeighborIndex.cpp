@@ -0,0 +1,105 @@
+#include "NeighborIndex.hpp"
+
+#include <cassert>
+#include <utility>
+
+using namespace std;
+
+const uint32_t NeighborIndex::none;
+
+namespace {
+
+const size_t minimumSize = 8;
+
+} // end anonymous namespace
+
+void NeighborIndex::reset(size_t expected)
+{
+	size_t newSize = minimumSize;
+	while (newSize < expected * 2)
+		newSize *= 2;
+
+	entries.clear();
+	count = 0;
+	rehash(newSize);
+}
+
+void NeighborIndex::clear()
+{
+	entries.clear();
+	entries.shrink_to_fit();
+	count = 0;
+	shift = 32;
+}
+
+void NeighborIndex::insert(uint32_t slot, uint32_t position)
+{
+	assert(slot != none);
+	assert(find(slot) == none);
+
+	// Stay at most half full
+	if ((count + 1) * 2 > entries.size())
+		rehash(max(entries.size() * 2, minimumSize));
+
+	size_t i = home(slot);
+	while (entries[i].slot != none)
+		i = (i + 1) & mask();
+
+	entries[i] = { slot, position };
+	++count;
+}
+
+void NeighborIndex::move(uint32_t slot, uint32_t position)
+{
+	entries[locate(slot)].position = position;
+}
+
+void NeighborIndex::erase(uint32_t slot)
+{
+	size_t hole = locate(slot);
+	--count;
+
+	// Walk the rest of the cluster, moving back any entry whose probe sequence passes through the hole,
+	// so that nobody's sequence is broken by the empty entry we're leaving.
+	for (size_t i = (hole + 1) & mask(); entries[i].slot != none; i = (i + 1) & mask()) {
+		const size_t h = home(entries[i].slot);
+		// The entry can fill the hole if its home isn't in the (circular) range (hole, i]
+		const bool homeAfterHole = hole <= i ? (hole < h && h <= i) : (hole < h || h <= i);
+		if (!homeAfterHole) {
+			entries[hole] = entries[i];
+			hole = i;
+		}
+	}
+
+	entries[hole].slot = none;
+}
+
+size_t NeighborIndex::locate(uint32_t slot) const
+{
+	assert(!entries.empty());
+
+	size_t i = home(slot);
+	while (entries[i].slot != slot) {
+		assert(entries[i].slot != none);
+		i = (i + 1) & mask();
+	}
+	return i;
+}
+
+void NeighborIndex::rehash(size_t newSize)
+{
+	assert(newSize >= minimumSize && (newSize & (newSize - 1)) == 0);
+
+	vector<Entry> old(newSize, Entry{ none, 0 });
+	swap(old, entries);
+
+	shift = 32;
+	for (size_t s = newSize; s > 1; s /= 2)
+		--shift;
+
+	count = 0;
+	for (const Entry& e : old) {
+		if (e.slot != none)
+			insert(e.slot, e.position);
+	}
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+/**
+ * \brief Finds where a neighbor sits in a peer's interestedList, given the neighbor's slot
+ *
+ * Every offer a peer considers credits the neighbor who made it, so looking neighbors up
+ * by walking the interestedList costs O(offers * neighbors) each tick.
+ * This is a small open-addressed hash table from slot to list position instead,
+ * so each lookup is O(1) expected.
+ *
+ * Collisions are resolved by linear probing, and erasing shifts the entries after the hole back
+ * into it (rather than leaving tombstones), so lookups never slow down as neighbors come and go.
+ * The table stays at most half full, growing as needed, so probe sequences stay short.
+ *
+ * It's up to the peer to tell us whenever a neighbor's position changes (see move()).
+ */
+class NeighborIndex {
+public:
+
+	static const uint32_t none = std::numeric_limits<uint32_t>::max();
+
+	NeighborIndex() : entries(), count(0), shift(32) { }
+
+	/// Sets the index up, empty, with room for _expected_ neighbors before it needs to grow
+	void reset(size_t expected);
+
+	/// Frees the index's memory
+	void clear();
+
+	/// The number of neighbors in the index
+	size_t size() const { return count; }
+
+	/// Returns the position of the neighbor in the given slot, or _none_ if it isn't in the index
+	uint32_t find(uint32_t slot) const
+	{
+		if (entries.empty())
+			return none;
+
+		for (size_t i = home(slot); ; i = (i + 1) & mask()) {
+			if (entries[i].slot == slot)
+				return entries[i].position;
+			if (entries[i].slot == none)
+				return none;
+		}
+	}
+
+	/// Adds a neighbor that isn't already in the index
+	void insert(uint32_t slot, uint32_t position);
+
+	/// Updates the position of a neighbor already in the index
+	void move(uint32_t slot, uint32_t position);
+
+	/// Takes a neighbor out of the index
+	void erase(uint32_t slot);
+
+private:
+
+	struct Entry {
+		uint32_t slot; ///< The neighbor's slot in the PeerStore, or _none_ for an empty entry
+		uint32_t position; ///< Where the neighbor is in the interestedList
+	};
+
+	size_t mask() const { return entries.size() - 1; }
+
+	/// Where a slot's probe sequence starts.
+	/// This is Fibonacci hashing: multiply by 2^32 / phi and keep the top bits,
+	/// which spreads out runs of nearby slots.
+	size_t home(uint32_t slot) const { return (uint32_t)(slot * 0x9E3779B9u) >> shift; }
+
+	/// Returns the index of the slot's entry, which must be there
+	size_t locate(uint32_t slot) const;
+
+	/// Rebuilds the table with the given number of entries, which must be a power of two
+	void rehash(size_t newSize);
+
+	std::vector<Entry> entries; ///< The table, whose size is a power of two (or zero before reset())
+	size_t count; ///< The number of neighbors in the table
+	unsigned shift; ///< 32 minus the log of the table's size, for home()
+};
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "PeerHandle.hpp"
+
+/// An offer of a chunk from one peer to another
+struct Offer {
+	PeerHandle from; ///< The peer offering the chunk
+	uint32_t chunkIdx; ///< The chunk being offered
+
+	Offer() : from(), chunkIdx(0) { }
+
+	Offer(PeerHandle f, size_t idx) : from(f), chunkIdx((uint32_t)idx) { }
+};
+
+/**
+ * \brief Holds every offer made in a tick, grouped by the peer receiving them
+ *
+ * Offers are made in parallel, so each worker appends to its own buffer (see buffer()).
+ * Once everyone is done, scatter() does a counting sort of all the buffered offers
+ * by their recipient's slot in the PeerStore into one flat array, so that each recipient's offers
+ * are contiguous (the "compressed sparse row" layout used for sparse matrices).
+ *
+ * All of the vectors are reused from tick to tick, so once they have grown to fit a typical tick,
+ * making and delivering offers does no heap allocation and needs no locks.
+ */
+class OfferStore {
+public:
+
+	/// An offer along with the peer it is being made to
+	struct Routed {
+		PeerHandle to;
+		Offer offer;
+
+		Routed(PeerHandle t, PeerHandle from, size_t chunkIdx) : to(t), offer(from, chunkIdx) { }
+	};
+
+	/// The offers made by a single worker
+	typedef std::vector<Routed> Buffer;
+
+	/// Creates a store with one append buffer for each of _numWorkers_ workers
+	explicit OfferStore(size_t numWorkers) :
+		buffers(numWorkers),
+		offsets(),
+		cursors(),
+		flat()
+	{ }
+
+	/// Gets the append buffer for a given worker
+	Buffer& buffer(size_t worker)
+	{
+		assert(worker < buffers.size());
+		return buffers[worker];
+	}
+
+	/// Empties the store for the next tick, keeping all of its memory around
+	void clear()
+	{
+		for (auto& b : buffers)
+			b.clear();
+		flat.clear();
+	}
+
+	/**
+	 * \brief Groups all buffered offers by recipient
+	 * \param numRecipients The number of possible recipient slots (see PeerStore::capacity)
+	 *
+	 * Offers to the same recipient keep the order they were made in, worker by worker.
+	 */
+	void scatter(size_t numRecipients)
+	{
+		// Count how many offers each recipient gets...
+		offsets.assign(numRecipients + 1, 0);
+		for (const auto& b : buffers) {
+			for (const auto& r : b) {
+				assert(r.to.index < numRecipients);
+				++offsets[r.to.index + 1];
+			}
+		}
+
+		// ...turn those counts into where each recipient's offers start...
+		for (size_t i = 1; i <= numRecipients; ++i)
+			offsets[i] += offsets[i - 1];
+
+		// ...then drop each offer into place.
+		flat.resize(offsets[numRecipients]);
+		cursors.assign(begin(offsets), end(offsets) - 1);
+		for (const auto& b : buffers) {
+			for (const auto& r : b)
+				flat[cursors[r.to.index]++] = r.offer;
+		}
+	}
+
+	/// The number of offers grouped by the last scatter()
+	size_t size() const { return flat.size(); }
+
+	/// The first offer made to the recipient in the given slot (valid after scatter())
+	Offer* offersBegin(size_t recipient) { return flat.data() + offsets[recipient]; }
+
+	/// One past the last offer made to the recipient in the given slot (valid after scatter())
+	Offer* offersEnd(size_t recipient) { return flat.data() + offsets[recipient + 1]; }
+
+private:
+
+	std::vector<Buffer> buffers; ///< Each worker's offers, in the order they were made
+	std::vector<size_t> offsets; ///< Where each recipient's offers start in flat
+	std::vector<size_t> cursors; ///< Scratch space for scatter()
+	std::vector<Offer> flat; ///< All offers, grouped by recipient
+};
@@ -5,8 +5,9 @@
 
 #include <algorithm>
 #include <cassert>
+#include <limits>
 
-#include "Printer.hpp"
+#include "PeerStore.hpp"
 
 using namespace std;
 
@@ -16,111 +17,248 @@ Peer::Peer (int IP, int upload, int download, size_t numChunks, bool isSeed) :
 	IPAddress(IP),
 	uploadRate(upload),
 	downloadRate(download),
-	chunkList(numChunks),
+	chunkList(numChunks, isSeed), // If we're the seed, fill our chunkList
 	interestedList(),
-	done(isSeed),
+	listedBy(),
+	owned(isSeed ? numChunks : 0),
 	// These don't need to be in the list, but -WeffC++,
 	// which provides warnings based on Effective C++ (a famous book),
 	// recommends putting all members in the initializer list.
-	consideredOffers(),
-	uploadMutex(),
-	uploadRemaining()
+	consideredBegin(nullptr),
+	consideredEnd(nullptr),
+	ranked(nullptr),
+	uploadRemaining(),
+	popularity(),
+	recentlyReceived(),
+	rarest(),
+	neighborPositions(),
+	reservations(),
+	firstPending(0),
+	claims(),
+	sources(),
+	candidates()
 {
-	// If we're the seed, fill our chunkList
+	// The seed starts out connected
 	if (isSeed)
-		fill(begin(chunkList), end(chunkList), true);
+		onConnect();
 }
 
-Peer::Peer(Peer&& o) :
-	IPAddress(o.IPAddress),
-	uploadRate(o.uploadRate),
-	downloadRate(o.downloadRate),
-	chunkList(o.chunkList),
-	interestedList(move(o.interestedList)),
-	done(o.done),
-	consideredOffers(move(o.consideredOffers)),
-	uploadMutex(), // You can't copy, move, or otherwise, a mutex
-	uploadRemaining(o.uploadRemaining)
+void Peer::onConnect()
 {
+	assert(interestedList.empty()); // This had better be empty
+	popularity.assign(chunkList.size(), 0);
+
+	// Nobody has anything yet, so all our chunks start out in the rarest bucket
+	rarest.reset(chunkList.size(), desiredPeerCount);
+	chunkList.forEachSet([&](size_t i) { rarest.insert(i, 0); });
+
+	neighborPositions.reset(desiredPeerCount);
 }
 
-void Peer::onDisconnect()
+void Peer::onDisconnect(const std::vector<uint8_t>& leaving, const PeerStore& store,
+                        std::vector<ListingChange>& changes)
 {
+	const uint32_t self = (uint32_t)store.slotOf(*this);
+
+	// Everyone who lists us either drops us with dropNeighbors or is leaving too,
+	// so there's nobody here we need to tell
+	listedBy.clear();
+	listedBy.shrink_to_fit();
+
 	// Go ahead and kill its interested list since we don't need it anymore
-	// and it will get a new one if/when we reconnect
+	// and it will get a new one if/when we reconnect.
+	// Our popularity counts are going away too, so just let our neighbors know we're gone.
+	for (const auto& n : interestedList) {
+		if (!leaving[n.index])
+			changes.push_back({ n.index, self, false });
+	}
 	interestedList.clear();
 	interestedList.shrink_to_fit();
+	neighborPositions.clear();
+
+	// Same goes for our popularity counts, which are only meaningful for the list
+	popularity.clear();
+	popularity.shrink_to_fit();
+	rarest.clear();
+
+	// Our neighbors have already counted these
+	recentlyReceived.clear();
+
+	reservations.clear();
+	reservations.shrink_to_fit();
+	claims.clear();
+	claims.shrink_to_fit();
+	sources.clear();
+	sources.shrink_to_fit();
+	candidates.clear();
+	candidates.shrink_to_fit();
 }
 
-void Peer::reorderPeers()
+void Peer::addNeighbor(PeerHandle h, PeerStore& store)
 {
-	for (auto& item : interestedList) {
-		// Peers that we can't help get the lowest possible contribution value (negative, even),
-		// so they will not appear at the top of our list.
-		if (!hasSomethingFor(*item.first))
-			item.second = numeric_limits<decltype(item.second)>::min();
-	}
+	store.at(h.index).updateListedBy(countNeighbor(h, store));
+}
 
-	// Sort by most contributions first
-	sort(begin(interestedList), end(interestedList), [](const pair<Peer*, int>&a, const pair<Peer*, int>& b) {
-		return a.second > b.second;
-	});
+std::vector<Peer::Neighbor>::iterator Peer::removeNeighbor(std::vector<Neighbor>::iterator it, PeerStore& store)
+{
+	store.at(it->index).updateListedBy(uncountNeighbor(it, store));
+	return eraseNeighbor(it);
+}
 
-	// Zero out the counts
-	for (auto& p : interestedList)
-		p.second = 0;
+void Peer::addNeighbor(PeerHandle h, const PeerStore& store, std::vector<ListingChange>& changes)
+{
+	changes.emplace_back(countNeighbor(h, store));
 }
 
-bool Peer::hasSomethingFor(const Peer& other) const
+std::vector<Peer::Neighbor>::iterator Peer::removeNeighbor(std::vector<Neighbor>::iterator it, const PeerStore& store,
+                                                           std::vector<ListingChange>& changes)
+{
+	changes.emplace_back(uncountNeighbor(it, store));
+	return eraseNeighbor(it);
+}
+
+void Peer::dropNeighbors(const std::vector<uint8_t>& leaving, const PeerStore& store)
 {
-	assert(chunkList.size() == other.chunkList.size());
-	for (size_t i = 0; i < chunkList.size(); ++i) {
-		// If we have a chunk they don't, return true
-		if (chunkList[i] && !other.chunkList[i])
-			return true;
+	// Erasing the leavers one at a time would shift everyone after each of them,
+	// so squeeze them all out in one pass instead, noting where everyone we keep ends up.
+	auto kept = begin(interestedList);
+	for (auto it = begin(interestedList); it != end(interestedList); ++it) {
+		if (leaving[it->index]) {
+			uncountNeighbor(it, store);
+			neighborPositions.erase(it->index);
+			continue;
+		}
+
+		if (kept != it) {
+			*kept = *it;
+			neighborPositions.move(kept->index, (uint32_t)(kept - begin(interestedList)));
+		}
+		++kept;
 	}
+	interestedList.erase(kept, end(interestedList));
+}
 
-	return false;
+std::vector<Peer::Neighbor>::iterator Peer::eraseNeighbor(std::vector<Neighbor>::iterator it)
+{
+	neighborPositions.erase(it->index);
+	it = interestedList.erase(it);
+
+	// Everyone after the one we erased moved up a spot
+	for (auto after = it; after != end(interestedList); ++after)
+		neighborPositions.move(after->index, (uint32_t)(after - begin(interestedList)));
+	return it;
 }
 
-std::vector<std::pair<Peer*, std::vector<size_t>>> Peer::makeOffers()
+void Peer::updateListedBy(const ListingChange& change)
 {
-	// Get out of here if we have nobody we are interested in
-	if (interestedList.empty() || uploadRate == 0)
-		return vector<pair<Peer*, vector<size_t>>>();
+	if (change.listed)
+		listedBy.emplace_back(change.lister);
+	else
+		unlist(change.lister);
+}
+
+Peer::ListingChange Peer::countNeighbor(PeerHandle h, const PeerStore& store)
+{
+	const Peer& p = store.at(h.index);
+	assert(store.isCurrent(h));
+	assert(p.chunkList.size() == chunkList.size());
+	assert(popularity.size() == chunkList.size());
+
+	neighborPositions.insert(h.index, (uint32_t)interestedList.size());
+	interestedList.emplace_back(h);
+	p.chunkList.forEachSet([&](size_t i) { adjustPopularity(i, +1); });
+	return { h.index, (uint32_t)store.slotOf(*this), true };
+}
+
+Peer::ListingChange Peer::uncountNeighbor(std::vector<Neighbor>::iterator it, const PeerStore& store)
+{
+	assert(popularity.size() == chunkList.size());
 
-	// Find the rarest chunks among our entire interested list
-	auto popularity = getChunkPopularity();
+	store.at(it->index).chunkList.forEachSet([&](size_t i) { adjustPopularity(i, -1); });
+	return { it->index, (uint32_t)store.slotOf(*this), false };
+}
+
+void Peer::unlist(uint32_t lister)
+{
+	// listedBy is in no particular order, so fill the hole with the last lister
+	auto it = find(begin(listedBy), end(listedBy), lister);
+	assert(it != end(listedBy));
+	*it = listedBy.back();
+	listedBy.pop_back();
+}
+
+void Peer::receiveChunk(size_t chunkIdx)
+{
+	assert(!chunkList[chunkIdx]);
+	chunkList.set(chunkIdx);
+	++owned;
+	recentlyReceived.emplace_back(chunkIdx);
+	rarest.insert(chunkIdx, popularity[chunkIdx]);
+}
 
-	// Now that we have our counts, remove any that we don't have to offer
-	std::vector<size_t> toRemove; // indices of elements to remove from popularity
-	for (size_t i = 0 ; i < chunkList.size(); ++i) {
-		if (!chunkList[i])
-			toRemove.emplace_back(i);
+void Peer::syncPopularity(const PeerStore& store)
+{
+	for (const auto& neighbor : interestedList) {
+		for (size_t chunkIdx : store.at(neighbor.index).recentlyReceived)
+			adjustPopularity(chunkIdx, +1);
 	}
+}
 
-	// Remove in reverse order (so that the indices don't change as we go)
-	for (auto it = toRemove.rbegin(); it != toRemove.rend(); ++it) {
-		// Erase takes an iterator, and we can get that from an index, i.e. *it
-		// by adding that index to begin()
-		popularity.erase(popularity.begin() + *it);
+void Peer::adjustPopularity(size_t chunkIdx, int delta)
+{
+	const int old = popularity[chunkIdx];
+	assert(old + delta >= 0);
+
+	popularity[chunkIdx] += delta;
+
+	// Chunks we have to offer need to move to their new bucket
+	if (chunkList[chunkIdx])
+		rarest.relocate(chunkIdx, old, popularity[chunkIdx]);
+}
+
+void Peer::reorderPeers(const PeerStore& store)
+{
+	for (auto& item : interestedList) {
+		// Peers that we can't help (or that have left) get the lowest possible contribution value
+		// (negative, even), so they will not appear at the top of our list.
+		const Peer* p = store.resolve(item.handle());
+		if (p == nullptr || !hasSomethingFor(*p))
+			item.contribution = numeric_limits<decltype(item.contribution)>::min();
 	}
 
-	// Popularity is now a list of chunks we have with their indices and how many peers have them.
-	// Let's sort by last-to-most popular chunks.
-	sort(begin(popularity), end(popularity), [](const pair<size_t, int>& a, const pair<size_t, int>& b) {
-		return a.second < b.second;
+	// Put the biggest contributors first. We only ever offer to the top few,
+	// and randomUnchoke picks from the rest at random, so the rest can stay in whatever order.
+	const auto top = begin(interestedList) + min(topToSend, interestedList.size());
+	partial_sort(begin(interestedList), top, end(interestedList), [](const Neighbor& a, const Neighbor& b) {
+		return a.contribution > b.contribution;
 	});
 
-	const auto recipientCount = min(topToSend, interestedList.size());
+	// Zero out the counts, and note where everyone ended up
+	for (size_t i = 0; i < interestedList.size(); ++i) {
+		interestedList[i].contribution = 0;
+		neighborPositions.move(interestedList[i].index, (uint32_t)i);
+	}
+}
+
+bool Peer::hasSomethingFor(const Peer& other) const
+{
+	// If we have a chunk they don't, return true
+	return chunkList.andNotAny(other.chunkList);
+}
+
+void Peer::makeOffers(PeerHandle self, const PeerStore& store, OfferStore::Buffer& out)
+{
+	// Get out of here if we have nobody we are interested in
+	if (interestedList.empty() || uploadRate == 0)
+		return;
 
-	// Set up our return value
-	vector<pair<Peer*, vector<size_t>>> ret(recipientCount);
+	const auto recipientCount = min(topToSend, interestedList.size());
 
-	// Set up our peer pointers quick
-	for (size_t i = 0; i < topToSend && i < interestedList.size(); ++i) {
-		ret[i].first = interestedList[i].first;
-	}
+	// Each peer we're sending to gets its own walk through our chunks, rarest first.
+	// Since each walk only moves forward, we never offer the same chunk to a peer twice.
+	RarityIndex::Cursor cursors[topToSend];
+	for (size_t i = 0; i < recipientCount; ++i)
+		cursors[i] = rarest.first();
 
 	size_t peerIdx = 0;
 	// Offer our entire upload bandwidth to each peer we are sending to
@@ -132,22 +270,21 @@ std::vector<std::pair<Peer*, std::vector<size_t>>> Peer::makeOffers()
 		size_t startingPoint = peerIdx;
 		do {
 			assert(peerIdx < interestedList.size());
-			Peer* top = interestedList[peerIdx].first;
-			assert(peerIdx < ret.size());
-			assert(ret[peerIdx].first == top);
-			vector<size_t>& currentOfferings = ret[peerIdx].second;
+			const PeerHandle topHandle = interestedList[peerIdx].handle();
+			const Peer* top = store.resolve(topHandle);
+			RarityIndex::Cursor& cursor = cursors[peerIdx];
 
-			if (top->hasEverything())
+			if (top == nullptr || top->hasEverything())
 				goto nextPeer; // Take a hike
 
 			// Find the rarest they want that we have and haven't offered yet
-			for (const auto& offering : popularity) {
-				// See if they don't have it and it's not already in our offer list
-				assert(offering.first < top->chunkList.size());
-				if (!top->chunkList[offering.first] &&
-				    find(begin(currentOfferings), end(currentOfferings), offering.first) == end(currentOfferings)) {
+			for (; !cursor.atEnd(); rarest.advance(cursor)) {
+				// See if they don't have it
+				assert(cursor.chunk < top->chunkList.size());
+				if (!top->chunkList[cursor.chunk]) {
 					// Offer a chunk!
-					currentOfferings.emplace_back(offering.first);
+					out.emplace_back(topHandle, self, cursor.chunk);
+					rarest.advance(cursor);
 					gaveSomething = true;
 					break;
 				}
@@ -167,113 +304,339 @@ nextPeer:
 	}
 
 	// Be sure to reset our number of upload slots remaining for this tick
-	uploadRemaining = uploadRate;
-
-	return ret;
+	uploadRemaining.reset(uploadRate);
 }
 
-std::vector<std::pair<size_t, int>> Peer::getChunkPopularity() const
+void Peer::considerOffers(Offer* begin, Offer* end)
 {
-	// Keeps track of how many of our connected peers (in interestList) have any given chunk
-	// The first item in the pair is the chunk index (because we'll reorder this later)
-	// The second item in the pair is how many peers have that chunk.
-	vector<pair<size_t, int>> popularity(chunkList.size());
-
-	for (size_t i = 0; i < chunkList.size(); ++i)
-		popularity[i].first = i;
-
-	// For each peer we're interested in sharing with
-	for (auto p : interestedList) {
-		const Peer* pp = p.first;
-		assert(pp->chunkList.size() == chunkList.size());
-
-		// Add their chunks to our count
-		for (size_t i = 0; i < chunkList.size(); ++i) {
-			if (pp->chunkList[i])
-				++popularity[i].second;
+	// Sanity check: We should only be getting offers for things we don't have
+#ifndef NDEBUG
+	for (const Offer* o = begin; o != end; ++o)
+		assert(!chunkList[o->chunkIdx]);
+#endif
+
+	assert(consideredBegin == consideredEnd);
+
+	consideredBegin = begin;
+	consideredEnd = end;
+	ranked = begin;
+
+	// Lets's group our offers by how popular they are.
+	// This is an American flag sort: count how many offers land in each bucket,
+	// then swap each offer into the next free spot in its bucket.
+	static const size_t numBuckets = desiredPeerCount + 1;
+	size_t next[numBuckets] = {};
+	size_t last[numBuckets];
+
+	for (const Offer* o = begin; o != end; ++o) {
+		assert(popularity[o->chunkIdx] >= 0 && popularity[o->chunkIdx] < (int)numBuckets);
+		++next[popularity[o->chunkIdx]];
+	}
+
+	// Turn the counts into where each bucket starts and ends
+	size_t start = 0;
+	for (size_t b = 0; b < numBuckets; ++b) {
+		const size_t count = next[b];
+		next[b] = start;
+		start += count;
+		last[b] = start;
+	}
+
+	for (size_t b = 0; b < numBuckets; ++b) {
+		while (next[b] < last[b]) {
+			Offer& o = begin[next[b]];
+			const size_t home = popularity[o.chunkIdx];
+			if (home == b)
+				++next[b];
+			else
+				swap(o, begin[next[home]++]);
 		}
 	}
+}
+
+void Peer::rankThrough(const Offer* offer)
+{
+	if (offer < ranked || offer == consideredEnd)
+		return;
 
-	return popularity;
+	// Find the end of the next bucket...
+	const int bucket = popularity[ranked->chunkIdx];
+	Offer* bucketEnd = ranked;
+	while (bucketEnd != consideredEnd && popularity[bucketEnd->chunkIdx] == bucket)
+		++bucketEnd;
+
+	// ...and sort it. Offers arrive in whatever order the workers made them, so break ties by chunk and sender
+	// to always end up with the same order. Nobody offers us the same chunk twice, so that's enough.
+	sort(ranked, bucketEnd, [](const Offer& a, const Offer& b) {
+		if (a.chunkIdx != b.chunkIdx)
+			return a.chunkIdx < b.chunkIdx;
+		return a.from.index < b.from.index;
+	});
+	ranked = bucketEnd;
 }
 
-void Peer::considerOffers(std::vector<std::pair<Peer*, std::vector<size_t>>>& offers)
+void Peer::acceptOffers(PeerStore& store)
 {
-	// Sanity check: We should only be getting offers for things we don't have
-#ifndef NDEBUG
-	for (auto& offerSet : offers) {
-		for (size_t offer : offerSet.second)
-			assert(!chunkList[offer]);
+	// Our neighbors counted last tick's chunks in their last syncPopularity
+	recentlyReceived.clear();
+	reservations.clear();
+
+	if (consideredBegin == consideredEnd)
+		return;
+
+	int downloaded = 0;
+	const Offer* offer = consideredBegin;
+	for (; downloaded < downloadRate && offer != consideredEnd; ++offer) {
+
+		rankThrough(offer);
+		const Offer& accepting = *offer; // The offer we're accepting
+
+		// If we have this chunk already, don't waste a download slot
+		if (chunkList[accepting.chunkIdx])
+			continue;
+
+		// See if the peer still has upload slots to use this tick
+		Peer& from = store.at(accepting.from.index);
+		if (!from.uploadRemaining.reserve())
+			continue;
+
+		// The caller prints what we took once everyone is done (see reservationsThisTick)
+		reservations.push_back({ accepting.from.index, accepting.chunkIdx, true });
+
+		receiveChunk(accepting.chunkIdx);
+
+		// Increment the chunks we downloaded
+		++downloaded;
 	}
-#endif
 
-	assert(consideredOffers.empty());
+	// Credit everyone whose offer we got to, whether we took it or not
+	credit(consideredBegin, offer);
+
+	// We're done with the considered offers
+	consideredBegin = consideredEnd = nullptr;
+}
+
+void Peer::beginReservations()
+{
+	// Our neighbors counted last tick's chunks in their last syncPopularity
+	recentlyReceived.clear();
+	reservations.clear();
+	firstPending = 0;
+}
+
+bool Peer::reserveOffers()
+{
+	// Take whatever was confirmed last round
+	for (size_t i = firstPending; i < reservations.size(); ++i) {
+		if (reservations[i].confirmed)
+			receiveChunk(reservations[i].chunkIdx);
+	}
+	firstPending = reservations.size();
+
+	int room = downloadRate - (int)recentlyReceived.size();
+
+	// Offers for the same chunk are next to each other (see considerOffers),
+	// so we only need to look at the last reservation to see if we've reserved a chunk this round.
+	// Any other offers for it are saved for the next round by moving them to the front of the considered offers.
+	Offer* saved = consideredBegin;
+	Offer* offer = consideredBegin;
+	for (; room > 0 && offer != consideredEnd; ++offer) {
+		rankThrough(offer);
+		if (reservations.size() > firstPending && reservations.back().chunkIdx == offer->chunkIdx) {
+			*saved++ = *offer;
+			continue;
+		}
+
+		credit(*offer);
 
-	auto popularity = getChunkPopularity();
+		// If we have this chunk already, don't waste a download slot
+		if (chunkList[offer->chunkIdx])
+			continue;
 
-	// Coalesce our offers into one big list
-	for (auto& offerSet : offers) {
-		for (size_t offer : offerSet.second)
-			consideredOffers.emplace_back(offerSet.first, offer);
+		reservations.push_back({ offer->from.index, offer->chunkIdx, false });
+		--room;
 	}
 
-	// We can free up the offers vector. We're all done with it.
-	// TODO: Should we do this? Could be shooting ourselves in the foot
-	//       if we forget later. Oh well.
-	offers.clear();
-	offers.shrink_to_fit();
+	// Slide the saved offers up against the ones we haven't gotten to, keeping them in order
+	const auto numSaved = saved - consideredBegin;
+	if (saved != offer)
+		copy_backward(consideredBegin, saved, offer);
+	consideredBegin = offer - numSaved;
+
+	return reservations.size() > firstPending;
+}
+
+void Peer::confirmReservations(PeerStore& store)
+{
+	if (interestedList.empty() || uploadRemaining.left() == 0)
+		return;
+
+	const uint32_t self = (uint32_t)store.slotOf(*this);
+
+	// Find this round's reservations made with us. We only made offers to our top few peers,
+	// so that's the only place they can come from.
+	claims.clear();
+	const auto recipientCount = min(topToSend, interestedList.size());
+	for (size_t i = 0; i < recipientCount; ++i) {
+		Peer* to = store.resolve(interestedList[i].handle());
+		if (to == nullptr)
+			continue;
+
+		// Each reservation is only ever confirmed by the peer it was made with,
+		// so nobody else is touching these.
+		for (size_t r = to->firstPending; r < to->reservations.size(); ++r) {
+			Reservation& reservation = to->reservations[r];
+			if (reservation.from == self)
+				claims.push_back({ &reservation, interestedList[i].index, popularity[reservation.chunkIdx] });
+		}
+	}
 
-	// Lets's sort all of our offers by how popular they are
-	sort(begin(consideredOffers), end(consideredOffers), [&] (const Offer& a, const Offer& b) {
-		return popularity[a.chunkIdx].second < popularity[b.chunkIdx].second;
+	sort(begin(claims), end(claims), [](const Claim& a, const Claim& b) {
+		if (a.popularity != b.popularity)
+			return a.popularity < b.popularity;
+		if (a.to != b.to)
+			return a.to < b.to;
+		return a.reservation->chunkIdx < b.reservation->chunkIdx;
 	});
+
+	for (const Claim& c : claims) {
+		if (!uploadRemaining.reserve())
+			break;
+		c.reservation->confirmed = true;
+	}
 }
 
-void Peer::acceptOffers()
+void Peer::finishReservations()
 {
-	if (consideredOffers.empty())
+	assert(firstPending == reservations.size());
+	consideredBegin = consideredEnd = nullptr;
+}
+
+void Peer::makeRequests(PeerHandle self, const PeerStore& store, OfferStore::Buffer& out)
+{
+	if (hasEverything() || downloadRate == 0)
 		return;
 
-	int downloaded = 0;
-	for (size_t offerIdx = 0; downloaded < downloadRate && offerIdx < consideredOffers.size(); ++offerIdx) {
+	// Find who's unchoking us. They're the peers that have us in the top few of their lists.
+	sources.clear();
+	for (uint32_t slot : listedBy) {
+		const Peer& from = store.at(slot);
+		const size_t unchoked = min(topToSend, from.interestedList.size());
+		const uint32_t position = from.neighborPositions.find(self.index);
+		if (from.uploadRate == 0 || position >= unchoked)
+			continue;
 
-		const Offer& accepting = consideredOffers[offerIdx]; // The offer we're accepting
+		if (!from.hasSomethingFor(*this))
+			continue;
 
-		// See if this peer sending us stuff is in our interested list
-		auto it = find_if(begin(interestedList), end(interestedList), [&](const pair<Peer*, int>& peer) {
-			return peer.first == accepting.from;
-		});
+		// They grant requests to the peers they unchoke in the order of their list (see grantRequests),
+		// so we get whatever the peers ahead of us can't use.
+		// We can't know what those peers will actually ask for, but they can't ask for more than
+		// what they lack, which keeps us from asking for more than we can get.
+		int share = from.uploadRate;
+		for (size_t i = 0; i < position && share > 0; ++i) {
+			const Peer* p = store.resolve(from.interestedList[i].handle());
+			if (p != nullptr)
+				share -= (int)min<size_t>(from.chunkList.andNotCount(p->chunkList), share);
+		}
+		if (share == 0)
+			continue;
 
-		// If he is, bump the count of things he's sent us.
-		// Even if it's a duplicate, they tried.
-		if (it != end(interestedList))
-			++it->second;
+		sources.push_back({ &from, store.handleOf(from), share });
+	}
 
-		// If we have this chunk already, don't waste a download slot
-		if (chunkList[accepting.chunkIdx])
+	// Each source lists the chunks it would have offered us, rarest first by its count
+	candidates.clear();
+	for (auto& s : sources) {
+		RarityIndex::Cursor cursor = s.peer->rarest.first();
+		for (int listed = 0; listed < s.peer->uploadRate && !cursor.atEnd(); s.peer->rarest.advance(cursor)) {
+			if (!chunkList[cursor.chunk]) {
+				candidates.emplace_back(s.handle, cursor.chunk);
+				++listed;
+			}
+		}
+	}
+
+	// Then we rank them all just like we would offers, and ask for the best we can,
+	// one source per chunk and no more than our share from each source.
+	considerOffers(candidates.data(), candidates.data() + candidates.size());
+
+	int room = downloadRate;
+	uint32_t lastChunk = RarityIndex::none;
+	for (const Offer* c = consideredBegin; room > 0 && c != consideredEnd; ++c) {
+		rankThrough(c);
+
+		// Candidates for the same chunk are next to each other
+		if (c->chunkIdx == lastChunk)
 			continue;
 
-		// See if the peer still has upload slots to use this tick
-		unique_lock<mutex> uploadLock(accepting.from->uploadMutex);
-		if (accepting.from->uploadRemaining == 0)
+		auto source = find_if(begin(sources), end(sources), [&](const Source& s) { return s.handle == c->from; });
+		assert(source != end(sources));
+		if (source->share == 0)
 			continue;
 
-		--accepting.from->uploadRemaining;
-		uploadLock.unlock();
+		out.emplace_back(c->from, self, c->chunkIdx);
+		lastChunk = c->chunkIdx;
+		--source->share;
+		--room;
+	}
 
-		printTransmit(accepting.from->IPAddress, accepting.chunkIdx, IPAddress);
+	consideredBegin = consideredEnd = nullptr;
+}
 
-		chunkList[accepting.chunkIdx] = true;
+void Peer::grantRequests(PeerHandle self, const Offer* begin, const Offer* end, OfferStore::Buffer& out) const
+{
+	if (begin == end)
+		return;
 
-		// Increment the chunks we downloaded
-		++downloaded;
+	// Each peer's requests arrive together, in the order it made them.
+	// Only the peers we unchoke ask us for anything, so we can file them by where they are in our list.
+	struct Run {
+		const Offer* next;
+		const Offer* end;
+	};
+	Run runs[topToSend] = {};
+
+	for (const Offer* r = begin; r != end;) {
+		const Offer* runEnd = r;
+		while (runEnd != end && runEnd->from == r->from)
+			++runEnd;
+
+		// Should someone we don't unchoke ask anyway (they left our list, say), ignore them
+		// rather than writing past the end of runs.
+		const uint32_t position = neighborPositions.find(r->from.index);
+		const Offer* runBegin = r;
+		r = runEnd;
+		if (position >= topToSend)
+			continue;
+
+		assert(runs[position].next == nullptr);
+		runs[position] = { runBegin, runEnd };
+	}
+
+	// Our best contributors go first. Splitting our upload slots evenly instead tends to leave
+	// everyone with nearly the same chunks, and so with little to trade.
+	int granted = 0;
+	for (auto& run : runs) {
+		for (; granted < uploadRate && run.next != run.end; ++run.next) {
+			out.emplace_back(run.next->from, self, run.next->chunkIdx);
+			++granted;
+		}
 	}
+}
 
-	done = all_of(begin(chunkList), end(chunkList), [](bool b) { return b; });
+void Peer::receiveGrants(Offer* begin, Offer* end)
+{
+	// Our neighbors counted last tick's chunks in their last syncPopularity
+	recentlyReceived.clear();
 
-	if (done)
-		printFinished(IPAddress, chunkList.size());
+	sort(begin, end, [](const Offer& a, const Offer& b) {
+		return a.chunkIdx < b.chunkIdx;
+	});
 
-	// We're done with the considered offers
-	consideredOffers.clear();
+	for (const Offer* g = begin; g != end; ++g) {
+		// We never ask for a chunk twice, so nothing we're granted is a duplicate
+		receiveChunk(g->chunkIdx);
+		credit(*g);
+	}
 }
@@ -4,36 +4,147 @@
 #pragma once
 
 #include <cstddef>
-#include <mutex>
+#include <cstdint>
+#include <limits>
 #include <random>
+#include <utility>
 #include <vector>
 
+#include "ChunkSet.hpp"
+#include "NeighborIndex.hpp"
+#include "OfferStore.hpp"
+#include "PeerHandle.hpp"
+#include "RarityIndex.hpp"
+#include "UploadCredit.hpp"
+
+class PeerStore;
+
 class Peer {
 public:
 
 	static const int desiredPeerCount = 40;
 
+	/**
+	 * \brief A peer in our interestedList, and how many chunks they've given us
+	 *
+	 * Every peer keeps up to desiredPeerCount of these, so the handle is unpacked
+	 * to fit the whole thing in 8 bytes.
+	 */
+	struct Neighbor {
+		uint32_t index; ///< The neighbor's PeerHandle::index
+		uint16_t generation; ///< The neighbor's PeerHandle::generation
+		int16_t contribution; ///< How many chunks they've sent us since we last reordered our list
+
+		explicit Neighbor(PeerHandle h) : index(h.index), generation(h.generation), contribution(0) { }
+
+		PeerHandle handle() const { return PeerHandle(index, generation); }
+	};
+
+	/// A peer being added to or dropped from another peer's listedBy,
+	/// for when that can't be done right away (see the addNeighbor and removeNeighbor overloads)
+	struct ListingChange {
+		uint32_t peer; ///< The slot of the peer whose listedBy is changing
+		uint32_t lister; ///< The slot of the peer that added or dropped them
+		bool listed; ///< True if _lister_ added _peer_ to its interestedList, false if it dropped them
+	};
+
+	/// A chunk we were offered and are holding one of the offering peer's upload slots for,
+	/// made when resolving offers deterministically (see reserveOffers)
+	struct Reservation {
+		uint32_t from; ///< The slot of the peer that offered us the chunk
+		uint32_t chunkIdx; ///< The chunk we want
+		bool confirmed; ///< Set by the offering peer's confirmReservations if it will send the chunk
+	};
+
 	// member variables
-	int simCounter = 0;  ///< peer's simulation counter
 	const int IPAddress;  ///< peer's IP address
 	const int uploadRate;  ///< peer's upload rate in chunks/second
 	const int downloadRate;  ///< peer's download rate in chunks/second (roughly 10X the upload rate)
-	std::vector<bool> chunkList;  ///< boolean array list of chunks that the peer has
+	ChunkSet chunkList;  ///< set of chunks that the peer has
 
 	/// Array of peers that this peer can request chunks from and how many chunks they've given us
-	std::vector<std::pair<Peer*, int>> interestedList;
+	std::vector<Neighbor> interestedList;
+
+	/// The slots of the peers that have us in their interestedList, in no particular order.
+	/// This lets us take ourselves out of those lists when we disconnect.
+	std::vector<uint32_t> listedBy;
 
 	Peer(int IP, int upload, int download, size_t numChunks, bool isSeed);
 
-	Peer(Peer&& o); // Add a move constructor
+	// No copy or assign. Peers stay put in the PeerStore for the whole run.
+	Peer(const Peer&) = delete;
+	Peer& operator=(const Peer&) = delete;
+
+	/// The number of chunks we have. Kept up to date as they arrive, so this is O(1).
+	size_t chunkCount() const { return owned; }
+
+	bool hasEverything() const { return owned == chunkList.size(); }
+
+	/// Called as the peer connects to set up the bookkeeping it needs while connected
+	void onConnect();
+
+	/**
+	 * \brief Called as the peer disconnects (along with whoever else leaves that tick)
+	 *        to minimize memory footprint when not in use
+	 * \param leaving For each slot, nonzero if that peer is disconnecting along with us
+	 * \param changes Where to record the changes to our neighbors' listedBy (see the addNeighbor overload)
+	 *
+	 * Everyone who lists us must drop us with dropNeighbors() (before, after, or at the same time),
+	 * unless they're leaving too, so nobody holds onto us (or offers us chunks) after we leave.
+	 * This only modifies us, so different peers can call it at the same time.
+	 * Neighbors that are leaving too aren't told, since they're forgetting who listed them anyway.
+	 */
+	void onDisconnect(const std::vector<uint8_t>& leaving, const PeerStore& store,
+	                  std::vector<ListingChange>& changes);
+
+	/// Drops every neighbor whose slot is flagged in _leaving_ from our interestedList
+	/// without touching the neighbors themselves (see onDisconnect).
+	/// This only modifies us, so different peers can call it at the same time.
+	void dropNeighbors(const std::vector<uint8_t>& leaving, const PeerStore& store);
+
+	/// Adds a peer to our interestedList, counting its chunks toward our popularity counts,
+	/// and adds us to its listedBy right away. The simulator always uses the overload that defers that,
+	/// so this is only a convenience for setting peers up by hand, as the tests do.
+	void addNeighbor(PeerHandle h, PeerStore& store);
+
+	/// Removes a peer from our interestedList, taking its chunks back out of our popularity counts,
+	/// and takes us out of its listedBy right away. Like the addNeighbor overload above, this is for tests.
+	std::vector<Neighbor>::iterator removeNeighbor(std::vector<Neighbor>::iterator it, PeerStore& store);
 
-	bool hasEverything() const { return done; }
+	/**
+	 * \brief Adds a peer to our interestedList without touching the peer itself
+	 * \param changes Where to record the change to the peer's listedBy,
+	 *                to be made with updateListedBy once it's safe to do so
+	 *
+	 * This only modifies us, so different peers can call it at the same time.
+	 */
+	void addNeighbor(PeerHandle h, const PeerStore& store, std::vector<ListingChange>& changes);
 
-	/// Called as the peer disconnects to minimize memory footprint when not in use
-	void onDisconnect();
+	/// Removes a peer from our interestedList without touching the peer itself (see the addNeighbor overload)
+	std::vector<Neighbor>::iterator removeNeighbor(std::vector<Neighbor>::iterator it, const PeerStore& store,
+	                                               std::vector<ListingChange>& changes);
+
+	/// Applies a change to our listedBy recorded by another peer's addNeighbor or removeNeighbor
+	void updateListedBy(const ListingChange& change);
+
+	/// Marks a chunk as received, so that our neighbors can pick it up in syncPopularity()
+	void receiveChunk(size_t chunkIdx);
+
+	/**
+	 * \brief Folds the chunks our neighbors received this tick into our popularity counts
+	 *
+	 * This must be called for every connected peer after every peer has accepted its offers,
+	 * and before anyone's interestedList changes.
+	 * Only a handful of chunks change hands each tick, so this is much cheaper than
+	 * recounting every neighbor's whole chunk list.
+	 */
+	void syncPopularity(const PeerStore& store);
+
+	/// The number of peers in our interestedList that have the given chunk
+	int getPopularity(size_t chunkIdx) const { return popularity[chunkIdx]; }
 
 	/// Order peers based on who gave us the most, then reset the counts
-	void reorderPeers();
+	void reorderPeers(const PeerStore& store);
 
 	bool hasSomethingFor(const Peer& other) const;
 
@@ -58,40 +169,220 @@ public:
 		size_t idxToUnchoke = unchoker(gen);
 
 		// Swap him with our currently unchoked peer
-		swap(interestedList[unchokedPosition], interestedList[idxToUnchoke]);
+		std::swap(interestedList[unchokedPosition], interestedList[idxToUnchoke]);
+		neighborPositions.move(interestedList[unchokedPosition].index, (uint32_t)unchokedPosition);
+		neighborPositions.move(interestedList[idxToUnchoke].index, (uint32_t)idxToUnchoke);
 	}
 
 	/**
-	 * \brief Returns a list of offers to peers from our interestedList
-	 * \returns The offers in the form of pairs.
-	 *          The first item in the pair is the peer we are offering to,
-	 *          and the second item is a list of indices of the chunks
+	 * \brief Makes offers to the top peers from our interestedList
+	 * \param self Our own handle, to sign the offers with
+	 * \param store The store our neighbors live in. Those that have disconnected are skipped.
+	 * \param out The buffer to append our offers to.
+	 *            Offers to a given peer are appended rarest chunk first.
+	 */
+	void makeOffers(PeerHandle self, const PeerStore& store, OfferStore::Buffer& out);
+
+	/**
+	 * \brief Ranks the offers made to us this tick
+	 * \param begin The first of our offers (see OfferStore::offersBegin)
+	 * \param end One past our last offer
+	 *
+	 * Offers are ranked by how popular their chunk is among our neighbors, rarest first,
+	 * then by chunk, then by who made them.
+	 * Popularity is a small number (no more than desiredPeerCount), so rather than sorting everything,
+	 * we bucket the offers by popularity in place here, in O(offers) time.
+	 * Each bucket is only sorted once acceptOffers or reserveOffers gets to it (see rankThrough),
+	 * and since those stop once we can't download any more, we usually only ever sort the first few.
+	 *
+	 * The offers are rearranged in place, and must stay put until acceptOffers is called.
+	 */
+	void considerOffers(Offer* begin, Offer* end);
+
+	/// Accepts as many of the offers from considerOffers as we can download,
+	/// reserving upload slots from the peers (in _store_) who made them.
+	/// Each offer taken is recorded as a confirmed reservation (see reservationsThisTick).
+	void acceptOffers(PeerStore& store);
+
+	// acceptOffers lets whoever gets to an uploader first have its upload slots,
+	// so the outcome depends on thread scheduling.
+	// The following resolve offers in rounds instead, so that the outcome only depends on the offers:
+	//
+	// 1. Every peer calls reserveOffers, reserving the best of its offers that it has room for.
+	// 2. Every peer calls confirmReservations, picking which reservations made with it to honor.
+	// 3. Every peer calls reserveOffers again, receiving what was confirmed and reserving more
+	//    with whatever room it has left. Steps 2 and 3 repeat until nobody reserves anything.
+	// 4. Every peer calls finishReservations.
+	//
+	// Each step only changes the peer it's called on (confirmReservations sets the _confirmed_ flag
+	// of other peers' reservations, but only ever those made with us), so each can run over all peers in parallel.
+
+	/// Clears out the last tick's reservations. Call before the first reserveOffers of a tick.
+	void beginReservations();
+
+	/**
+	 * \brief Receives the chunks confirmed in the last round, then reserves more
+	 * \returns true if we reserved anything this round
+	 *
+	 * Offers are reserved in the order considerOffers ranked them, up to our download rate.
+	 * A chunk is only reserved from one peer per round. If several peers offered it,
+	 * the other offers are saved for the next round in case the first peer turns us down.
+	 * As in acceptOffers, every offer we get to credits the neighbor who made it.
 	 */
-	std::vector<std::pair<Peer*, std::vector<size_t>>> makeOffers();
+	bool reserveOffers();
 
-	void considerOffers(std::vector<std::pair<Peer*, std::vector<size_t>>>& offers);
+	/**
+	 * \brief Confirms as many of this round's reservations made with us as we have upload slots for
+	 * \param store The store our neighbors live in
+	 *
+	 * Reservations for the chunks that are rarest among our neighbors go first,
+	 * then ties go to the peer in the lowest slot.
+	 */
+	void confirmReservations(PeerStore& store);
+
+	/// Wraps up after the last round
+	void finishReservations();
+
+	/// The reservations we made this tick, confirmed or not (valid after finishReservations),
+	/// or the offers acceptOffers took, which are all confirmed
+	const std::vector<Reservation>& reservationsThisTick() const { return reservations; }
 
-	void acceptOffers();
+	// Chunks can also change hands by request and grant instead of by offer.
+	// Each uploader offers its whole upload rate to each of the peers it unchokes, but can only send
+	// its upload rate in total, so most offers go to waste. Instead, each peer can ask the peers
+	// that unchoke it for what it wants, and each uploader grants as many requests as it can send:
+	//
+	// 1. Every peer calls makeRequests.
+	// 2. Every peer calls grantRequests with the requests made to it.
+	// 3. Every peer calls receiveGrants with the grants made to it.
+	//
+	// Each step only changes the peer it's called on, so each can run over all peers in parallel,
+	// and none of them depend on the order peers are visited in.
+
+	/**
+	 * \brief Asks the peers that unchoke us for the chunks we want, up to our download rate
+	 * \param self Our own handle, to sign the requests with
+	 * \param store The store our neighbors live in
+	 * \param out The buffer to append our requests to, addressed to the peers we're asking
+	 *
+	 * A peer unchokes us if we're in the top few of its interestedList (see makeOffers).
+	 * Each one lists the chunks it would have offered us, and we rank those as we would offers
+	 * (see considerOffers), asking for each chunk from just one peer.
+	 * Uploaders grant requests in the order of their interestedLists (see grantRequests),
+	 * so we ask each for no more than the peers ahead of us could leave us.
+	 */
+	void makeRequests(PeerHandle self, const PeerStore& store, OfferStore::Buffer& out);
+
+	/**
+	 * \brief Grants as many of the requests made to us as our upload rate allows
+	 * \param self Our own handle, to sign the grants with
+	 * \param begin The first request made to us (see OfferStore::offersBegin). Each one is _from_ who's asking.
+	 * \param end One past the last request made to us
+	 * \param out The buffer to append our grants to, addressed to the peers who asked
+	 *
+	 * Requests are granted in the order of our interestedList, so our best contributors go first,
+	 * and each peer's requests are granted in the order they were made.
+	 */
+	void grantRequests(PeerHandle self, const Offer* begin, const Offer* end, OfferStore::Buffer& out) const;
+
+	/**
+	 * \brief Receives the chunks granted to us this tick, crediting whoever sent them
+	 * \param begin The first grant made to us (see OfferStore::offersBegin)
+	 * \param end One past the last grant made to us
+	 *
+	 * The grants are sorted by chunk in place, so that they can be printed in the same order every run.
+	 */
+	void receiveGrants(Offer* begin, Offer* end);
 
 private:
 
-	struct Offer {
-		Peer* from;
-		size_t chunkIdx;
+	static const size_t topToSend = 5; // Send to the top 5 peers (4 + 1 optimistically unchoked)
+
+	size_t owned; ///< The number of chunks in chunkList
+
+	Offer* consideredBegin; ///< The first of the offers we're considering this tick
+	Offer* consideredEnd; ///< One past the last of the offers we're considering this tick
+	Offer* ranked; ///< The considered offers before this one are in their final order
+
+	UploadCredit uploadRemaining; ///< Our upload slots left this tick
+
+	/// For each chunk, how many peers in our interestedList have it.
+	/// Kept up to date incrementally (see addNeighbor, removeNeighbor, and syncPopularity)
+	/// and only allocated while we're connected.
+	std::vector<int> popularity;
+
+	/// Chunks we received in this tick's acceptOffers, which our neighbors still need to count
+	std::vector<size_t> recentlyReceived;
 
-		Offer(Peer* f, size_t idx) : from(f), chunkIdx(idx) { }
+	/// The chunks we have, bucketed by popularity so makeOffers can go rarest-first without sorting
+	RarityIndex rarest;
+
+	/// Where each peer in our interestedList sits in it, by slot, so offers can be credited in O(1).
+	/// Kept up to date whenever the list changes, and only allocated while we're connected.
+	NeighborIndex neighborPositions;
+
+	std::vector<Reservation> reservations; ///< The reservations we made this tick (see reserveOffers)
+	size_t firstPending; ///< The first of _reservations_ made in the current round
+
+	/// A reservation made with us, and who made it. Scratch space for confirmReservations.
+	struct Claim {
+		Reservation* reservation;
+		uint32_t to; ///< The slot of the peer that made the reservation
+		int popularity; ///< How many of our neighbors have the chunk
 	};
+	std::vector<Claim> claims;
 
-	static const size_t topToSend = 5; // Send to the top 5 peers (4 + 1 optimistically unchoked)
+	/// A peer that unchokes us. Scratch space for makeRequests.
+	struct Source {
+		const Peer* peer;
+		PeerHandle handle;
+		int share; ///< How many more chunks we can ask it for
+	};
+	std::vector<Source> sources;
+
+	/// The chunks makeRequests could ask for, and who from
+	std::vector<Offer> candidates;
+
+	/// Bumps the contribution of the neighbor who made an offer, if they're still in our interestedList
+	void credit(const Offer& offer)
+	{
+		const uint32_t position = neighborPositions.find(offer.from.index);
+		if (position == NeighborIndex::none)
+			return;
+
+		// If they're still who they were when they made the offer, bump the count of things they've sent us.
+		// Even if it's a duplicate, they tried.
+		Neighbor& n = interestedList[position];
+		if (n.generation == offer.from.generation && n.contribution < std::numeric_limits<int16_t>::max())
+			++n.contribution;
+	}
+
+	/// Credits a run of offers all at once, for when we're done going through them
+	void credit(const Offer* begin, const Offer* end)
+	{
+		for (; begin != end; ++begin)
+			credit(*begin);
+	}
+
+	/// Erases a neighbor from our interestedList, keeping neighborPositions up to date
+	std::vector<Neighbor>::iterator eraseNeighbor(std::vector<Neighbor>::iterator it);
 
-	bool done;
+	/// Makes sure the given considered offer is in its final place,
+	/// sorting the next bucket of equally popular offers if need be (see considerOffers)
+	void rankThrough(const Offer* offer);
 
-	std::vector<Offer> consideredOffers;
+	/// Changes a chunk's popularity count, keeping rarest up to date
+	void adjustPopularity(size_t chunkIdx, int delta);
 
-	std::mutex uploadMutex;
+	/// Takes the peer in the given slot out of our listedBy
+	void unlist(uint32_t lister);
 
-	int uploadRemaining;
+	/// Adds a peer to our interestedList and popularity counts,
+	/// and returns the change that needs to be made to its listedBy
+	ListingChange countNeighbor(PeerHandle h, const PeerStore& store);
 
-	std::vector<std::pair<size_t, int>> getChunkPopularity() const;
+	/// Takes a peer out of our popularity counts (but not our interestedList),
+	/// and returns the change that needs to be made to its listedBy
+	ListingChange uncountNeighbor(std::vector<Neighbor>::iterator it, const PeerStore& store);
 
 };
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+
+/**
+ * \brief A compact reference to a peer in the PeerStore
+ *
+ * Peers refer to each other (in interestedLists and offers) by the index of the slot they live in,
+ * along with the generation of that slot, which the store bumps every time the peer disconnects.
+ * A handle made before a peer left no longer matches its slot's generation,
+ * so references to peers that have since gone away can be spotted (see PeerStore::isCurrent)
+ * instead of silently pointing at someone else.
+ *
+ * Generations are 16 bits and wrap around, so a handle held across 65,536 disconnects
+ * of the same peer would look current again. Nothing in the simulator holds onto one nearly that long.
+ */
+struct PeerHandle {
+	static const uint32_t none = std::numeric_limits<uint32_t>::max();
+
+	uint32_t index; ///< The peer's slot in the PeerStore
+	uint16_t generation; ///< The slot's generation when the handle was made
+
+	PeerHandle() : index(none), generation(0) { }
+
+	PeerHandle(uint32_t i, uint16_t gen) : index(i), generation(gen) { }
+
+	bool operator==(const PeerHandle& o) const { return index == o.index && generation == o.generation; }
+
+	bool operator!=(const PeerHandle& o) const { return !operator==(o); }
+};
@@ -0,0 +1,86 @@
+#include "PeerStore.hpp"
+
+#include <limits>
+
+using namespace std;
+
+const uint32_t PeerStore::notIncomplete;
+
+PeerStore::PeerStore(size_t blockSize) :
+	peers(blockSize, true),
+	membership(),
+	connected(),
+	disconnected(),
+	incomplete(),
+	completed(0)
+{
+}
+
+void PeerStore::connect(const Peer& p)
+{
+	const size_t slot = slotOf(p);
+	assert(!membership[slot].connected);
+	leave(slot);
+	join(slot, true);
+}
+
+void PeerStore::disconnect(const Peer& p)
+{
+	const size_t slot = slotOf(p);
+	assert(membership[slot].connected);
+	leave(slot);
+	join(slot, false);
+	++membership[slot].generation;
+}
+
+void PeerStore::markComplete(const Peer& p)
+{
+	assert(p.hasEverything());
+	const size_t slot = slotOf(p);
+	assert(membership[slot].connected);
+	if (!membership[slot].complete) {
+		membership[slot].complete = true;
+		++completed;
+	}
+	leaveIncomplete(slot);
+}
+
+void PeerStore::join(size_t slot, bool connect)
+{
+	assert(slot < numeric_limits<uint32_t>::max());
+	auto& list = connect ? connected : disconnected;
+	membership[slot].connected = connect;
+	membership[slot].position = (uint32_t)list.size();
+	list.emplace_back((uint32_t)slot);
+
+	if (connect && !peers.at(slot).hasEverything()) {
+		membership[slot].incompletePosition = (uint32_t)incomplete.size();
+		incomplete.emplace_back((uint32_t)slot);
+	}
+}
+
+void PeerStore::leave(size_t slot)
+{
+	auto& list = membership[slot].connected ? connected : disconnected;
+	const uint32_t position = membership[slot].position;
+	assert(list[position] == slot);
+
+	list[position] = list.back();
+	membership[list[position]].position = position;
+	list.pop_back();
+
+	leaveIncomplete(slot);
+}
+
+void PeerStore::leaveIncomplete(size_t slot)
+{
+	const uint32_t position = membership[slot].incompletePosition;
+	if (position == notIncomplete)
+		return;
+
+	assert(incomplete[position] == slot);
+	incomplete[position] = incomplete.back();
+	membership[incomplete[position]].incompletePosition = position;
+	incomplete.pop_back();
+	membership[slot].incompletePosition = notIncomplete;
+}
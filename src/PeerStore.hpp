@@ -0,0 +1,233 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "Peer.hpp"
+#include "PeerHandle.hpp"
+#include "Pool.hpp"
+
+/**
+ * \brief Holds every peer in the swarm, connected or not
+ *
+ * Each peer is constructed once, in a slot of a growable Pool, and stays there for the rest of the run,
+ * so its address and slot index never change.
+ * Connecting or disconnecting a peer just flips its state and moves its slot index
+ * from one dense list to the other.
+ * The lists are unordered and each slot remembers where it sits in its list,
+ * so both moves are an O(1) swap-and-pop.
+ *
+ * The dense list of connected peers is what the simulator walks (and splits among threads) each tick,
+ * so disconnected peers cost it nothing.
+ *
+ * Peers refer to each other with PeerHandles. Each slot has a generation,
+ * which is bumped when its peer disconnects, so handles from before then stop being current.
+ *
+ * The store also keeps a third dense list of the connected peers that don't have everything yet,
+ * since those are the only ones worth making new neighbors of. sampleIncomplete() draws from it
+ * in time proportional to the number of peers drawn, not the size of the swarm.
+ * Connecting and disconnecting keep it up to date, but since peers finish downloading
+ * in the middle of a parallel phase, the simulator has to tell us when they do (see markComplete()).
+ * That also lets us keep count of how many peers have everything, so the simulator can tell
+ * when the whole swarm is done without looking at every peer.
+ */
+class PeerStore {
+public:
+
+	/// \param blockSize How many peers to make room for at a time as the swarm grows
+	explicit PeerStore(size_t blockSize);
+
+	/**
+	 * \brief Constructs a new peer in the store
+	 * \param connect Whether the peer starts out connected
+	 * \param args The arguments to Peer's constructor
+	 */
+	template <typename... Args>
+	Peer& add(bool connect, Args&&... args)
+	{
+		Peer* p = peers.construct(std::forward<Args>(args)...);
+
+		// Peers are never removed, so slots are handed out in order
+		const size_t slot = peers.indexOf(p);
+		assert(slot == membership.size());
+		membership.emplace_back();
+		if (p->hasEverything()) {
+			membership.back().complete = true;
+			++completed;
+		}
+		join(slot, connect);
+		return *p;
+	}
+
+	/// Moves a disconnected peer to the connected list. O(1).
+	void connect(const Peer& p);
+
+	/// Moves a connected peer to the disconnected list, invalidating handles to it. O(1).
+	void disconnect(const Peer& p);
+
+	/// Takes a connected peer that just got everything out of the incomplete list,
+	/// and counts it as complete. O(1).
+	void markComplete(const Peer& p);
+
+	/// The number of peers that have everything (as of the last markComplete())
+	size_t completeCount() const { return completed; }
+
+	/// Returns true if every peer has everything. O(1).
+	bool allComplete() const { return completed == membership.size(); }
+
+	bool isConnected(const Peer& p) const { return membership[slotOf(p)].connected; }
+
+	/// Makes a handle to a peer, good until it next disconnects
+	PeerHandle handleOf(const Peer& p) const { return handleAt(slotOf(p)); }
+
+	/// Returns true if the handle's peer hasn't disconnected since the handle was made
+	bool isCurrent(PeerHandle h) const
+	{
+		assert(h.index < membership.size());
+		return membership[h.index].generation == h.generation;
+	}
+
+	/// Returns the handle's peer, or null if it has disconnected since the handle was made
+	Peer* resolve(PeerHandle h) { return isCurrent(h) ? &at(h.index) : nullptr; }
+
+	const Peer* resolve(PeerHandle h) const { return isCurrent(h) ? &at(h.index) : nullptr; }
+
+	/// The number of peers in the store
+	size_t size() const { return membership.size(); }
+
+	/// An upper bound on slot indices, for keeping per-peer data in flat arrays
+	size_t capacity() const { return peers.max_size(); }
+
+	/// The index of the slot a peer lives in, which is in [0, capacity())
+	size_t slotOf(const Peer& p) const { return peers.indexOf(&p); }
+
+	Peer& at(size_t slot) { return peers.at(slot); }
+
+	const Peer& at(size_t slot) const { return peers.at(slot); }
+
+	size_t connectedCount() const { return connected.size(); }
+
+	size_t disconnectedCount() const { return disconnected.size(); }
+
+	/// The _i_th connected peer, with _i_ in [0, connectedCount()). The order is arbitrary.
+	Peer& connectedPeer(size_t i) { return peers.at(connected[i]); }
+
+	/// A handle to connectedPeer(i)
+	PeerHandle connectedHandle(size_t i) const { return handleAt(connected[i]); }
+
+	/// The _i_th disconnected peer, with _i_ in [0, disconnectedCount()). The order is arbitrary.
+	Peer& disconnectedPeer(size_t i) { return peers.at(disconnected[i]); }
+
+	/// The number of connected peers that don't have everything
+	size_t incompleteCount() const { return incomplete.size(); }
+
+	/**
+	 * \brief Picks up to _num_ distinct connected peers that don't have everything yet, at random
+	 * \param ignore Peers not to pick (compared by slot, so stale handles still count)
+	 * \param out Where to append handles to the peers we pick
+	 *
+	 * Peers are drawn by rejection sampling against the ignore list and the peers picked so far,
+	 * which both hold a few dozen entries at most, so this is O(num + ignore.size()) expected time
+	 * while most of the incomplete list is up for grabs.
+	 * When it isn't, we just walk the list, which is then no more than twice as big as what we want.
+	 */
+	template <typename RNG>
+	void sampleIncomplete(size_t num, const std::vector<PeerHandle>& ignore, RNG& rng,
+	                      std::vector<PeerHandle>& out) const
+	{
+		auto ignored = [&](uint32_t slot) {
+			for (PeerHandle h : ignore) {
+				if (h.index == slot)
+					return true;
+			}
+			return false;
+		};
+
+		// Figure out how many peers we can actually pick from
+		size_t available = incomplete.size();
+		for (PeerHandle h : ignore) {
+			if (available > 0 && h.index < membership.size()
+			    && membership[h.index].incompletePosition != notIncomplete)
+				--available;
+		}
+
+		const size_t firstPicked = out.size();
+		num = std::min(num, available);
+
+		if (num * 2 >= available) {
+			// We want most of what's left, so just take everyone and pick among them
+			for (uint32_t slot : incomplete) {
+				if (!ignored(slot))
+					out.emplace_back(handleAt(slot));
+			}
+			std::shuffle(out.begin() + firstPicked, out.end(), rng);
+			out.resize(firstPicked + num);
+			return;
+		}
+
+		auto picked = [&](uint32_t slot) {
+			for (size_t i = firstPicked; i < out.size(); ++i) {
+				if (out[i].index == slot)
+					return true;
+			}
+			return false;
+		};
+
+		// Otherwise, at least half of the list is fair game, so each draw succeeds at least half the time.
+		std::uniform_int_distribution<size_t> pick(0, incomplete.size() - 1);
+		while (out.size() - firstPicked < num) {
+			const uint32_t slot = incomplete[pick(rng)];
+			if (!ignored(slot) && !picked(slot))
+				out.emplace_back(handleAt(slot));
+		}
+	}
+
+	// Iterates over all peers, connected or not
+
+	Pool<Peer>::iterator begin() { return peers.begin(); }
+
+	Pool<Peer>::const_iterator begin() const { return peers.begin(); }
+
+	Pool<Peer>::iterator end() { return peers.end(); }
+
+	Pool<Peer>::const_iterator end() const { return peers.end(); }
+
+private:
+
+	static const uint32_t notIncomplete = std::numeric_limits<uint32_t>::max();
+
+	/// Which lists a slot is in, and where
+	struct Membership {
+		uint32_t position = 0; ///< The slot's index in _connected_ or _disconnected_
+		uint32_t incompletePosition = notIncomplete; ///< The slot's index in _incomplete_, if it's there
+		uint16_t generation = 0; ///< Bumped each time the peer disconnects (see PeerHandle)
+		bool connected = false;
+		bool complete = false; ///< Set once the peer has everything (see markComplete())
+	};
+
+	PeerHandle handleAt(size_t slot) const { return PeerHandle((uint32_t)slot, membership[slot].generation); }
+
+	/// Appends a slot to the end of the list for the given state
+	void join(size_t slot, bool connect);
+
+	/// Removes a slot from whichever list it's in, filling the hole with the list's last slot
+	void leave(size_t slot);
+
+	/// Takes a slot out of _incomplete_ if it's there, filling the hole with the list's last slot
+	void leaveIncomplete(size_t slot);
+
+	Pool<Peer> peers; ///< Where the peers actually live
+
+	std::vector<Membership> membership; ///< Indexed by slot
+	std::vector<uint32_t> connected; ///< The slots of connected peers
+	std::vector<uint32_t> disconnected; ///< The slots of disconnected peers
+	std::vector<uint32_t> incomplete; ///< The slots of connected peers that don't have everything
+
+	size_t completed; ///< The number of peers marked complete
+};
@@ -1,13 +1,18 @@
 #pragma once
 
+#include <algorithm>
 #include <exception>
 #include <cassert>
+#include <cstdint>
 #include <cstdlib>
+#include <functional>
 #include <memory>
 #include <new>
+#include <stdexcept>
 #include <utility>
 #include <type_traits>
 #include <queue>
+#include <vector>
 
 // Forward declaration (this comes after the pool itself)
 template <typename T>
@@ -40,9 +45,22 @@ class PoolIterator;
  * These objects will also have good spatial locality,
  * given that they are in the same pool.
  *
+ * If we don't know up front how many objects we'll need, the pool can instead be
+ * made growable, in which case it allocates another fixed-size block of slots whenever it runs out.
+ * Blocks are never moved or freed until the pool is destroyed, so pointers and iterators
+ * to objects in the pool stay valid as it grows, and objects are still packed together
+ * a block at a time. Slots are numbered across blocks (see indexOf()),
+ * with each growable block holding a power of two slots so that finding a slot
+ * from its index is a shift and a mask.
+ *
  * In order to track which slots in the pool are in use and which aren't,
- * this class stores a singly-linked list of free slots _inside_ the free slots
- * (see the Slot union).
+ * this class stores a doubly-linked list of free slots _inside_ the free slots
+ * (see the Slot union), along with a bitmap of which slots are occupied.
+ * The free list is unsorted: construct() pops a slot off its front
+ * and destroy() pushes the slot back on, both in O(1).
+ * Everything that cares about slot order (iteration, first-fit allocation of
+ * several contiguous slots, and checking slots by index with isOccupied())
+ * uses the bitmap instead, which skips 64 free slots at a time.
  *
  * At this point, you may be wondering: Isn't there
  * [boost::pool](http://www.boost.org/doc/libs/1_55_0/libs/pool/doc/html/index.html)?
@@ -79,28 +97,25 @@ public:
 
 	/**
 	 * \brief Constructs a pool of a given size
-	 * \param poolSize The maximum number of elements this pool will be able to store
+	 * \param poolSize The maximum number of elements this pool will be able to store,
+	 *                 or if _canGrow_ is set, the number of elements it grows by at a time
+	 *                 (rounded up to a power of two)
+	 * \param canGrow If true, the pool allocates another block of slots when it runs out,
+	 *                instead of throwing std::bad_alloc
 	 * \throws std::bad_alloc if enough memory for the pool cannot be allocated with malloc
 	 */
-	Pool(size_t poolSize) :
-		buff(nullptr),
+	Pool(size_t poolSize, bool canGrow = false) :
+		blocks(),
+		blocksByAddress(),
+		blockShift(shiftFor(poolSize)),
+		growable(canGrow),
 		firstFree(nullptr),
-		numSlots(poolSize),
-		numAllocated(0)
+		numSlots(0),
+		numAllocated(0),
+		occupied()
 	{
-		buff = static_cast<Slot*>(malloc(poolSize * sizeof(Slot)));
-		if (buff == nullptr)
-			throw std::bad_alloc();
-
-		// Initialize all our slots. Since they all start free,
-		// they will point to the next slot.
-		for (size_t i = 0; i < poolSize; ++i)
-			buff[i].next = &buff[i + 1];
-
-		// The last slot's next pointer should point to null
-		buff[poolSize - 1].next = nullptr;
-		// The first free slot is our first slot
-		firstFree = &buff[0];
+		assert(poolSize > 0);
+		addBlock(canGrow ? blockCapacity() : poolSize);
 	}
 
 	/**
@@ -108,18 +123,19 @@ public:
 	 *
 	 * We don't particularly care if all of the slots have been freed -
 	 * maybe the pointers we handed out weren't used and this is just being used as a normal container.
-	 * Freeing the buffer will release all of our memory, anyways, so go ahead.
+	 * Freeing the buffers will release all of our memory, anyways, so go ahead.
 	 */
 	~Pool()
 	{
-		free(buff);
+		for (Slot* block : blocks)
+			free(block);
 	}
 
 	/// A convenience function to get an allocator for this pool
 	PoolAllocator<T> getAllocator() { return PoolAllocator<T>(*this); }
 
 	/**
-	 * \brief Gets the number of free slots
+	 * \brief Gets the number of free slots (before the pool has to grow, if it can)
 	 *
 	 * Complexity is O(1) with NDEBUG defined
 	 * and O(n) otherwise.
@@ -129,7 +145,7 @@ public:
 #ifndef NDEBUG
 		// Just walk the free list until we hit null
 		size_t check = 0;
-		for (Slot* curr = firstFree; curr != nullptr; curr = curr->next)
+		for (Slot* curr = firstFree; curr != nullptr; curr = curr->free.next)
 			++check;
 
 		assert(check == numSlots - numAllocated);
@@ -146,6 +162,7 @@ public:
 
 	/**
 	 * \brief  Returns the maximum number of allocations that can be made from the pool
+	 *         (before it has to grow, if it can). Slot indices are in [0, max_size()).
 	 *
 	 * Complexity is O(1)
 	 */
@@ -159,7 +176,7 @@ public:
 	bool empty() const { return numAllocated == 0; }
 
 	/**
-	 * \brief Returns true if no slots in the pool are free
+	 * \brief Returns true if no slots in the pool are free (without growing it)
 	 *
 	 * Complexity is O(1)
 	 */
@@ -170,54 +187,65 @@ public:
 	 *        _num_ contiguous objects and returns a pointer to the first one
 	 * \param num The number of contiguous objects to allocate from the pool
 	 * \throws std::bad_alloc if there is not enough space for _num_ congituous objects
-	 *         anywhere in the pool
-	 * \todo This could be optimized for the case where we are allocating
-	 *       a single slot.
+	 *         anywhere in the pool, and the pool can't grow to make room
+	 *         (it can never fit more than one block's worth).
 	 *
 	 * Allocation is done by first-fit, and, in the case of a tie,
 	 * by whatever block is first in the pool.
+	 * Contiguous objects are always within the same block.
 	 *
-	 * Complexity is O(n), as we must search for free blocks via the
-	 * free list.
+	 * Complexity is O(n / 64 + num), as we search the occupancy bitmap for free blocks,
+	 * skipping full words at a time. construct() doesn't care where its slot is,
+	 * so it uses an O(1) path instead.
 	 *
 	 * This function is mainly intneded for use with a PoolAllocator
 	 * and probably shouldn't be used raw.
 	 */
 	T* allocate(size_t num)
 	{
-		// Iterate through our free list, finding contiguous chunks
-		Slot** curr = &firstFree;
-		std::pair<size_t, Slot**> countInfo = getContiguousCount(*curr);
-		for (; *curr != nullptr; curr = countInfo.second, countInfo = getContiguousCount(*curr)) {
-			// If a chunk can fit our needed size, take it
-			if (countInfo.first >= num) {
-				numAllocated += num;
-				T* ret = (T*)*curr;
-				// Set our previous "next free" pointer to
-				// the next pointer at the end of this block,
-				// effectively skipping this block
-				*curr = (*curr)[num - 1].next;
-				return ret;
+		assert(num > 0);
+
+		size_t start = nextFree(0);
+		while (true) {
+			while (start + num <= numSlots) {
+				// Runs can't cross from one block into the next
+				const size_t blockEnd = std::min(((start >> blockShift) + 1) << blockShift, numSlots);
+				if (start + num > blockEnd) {
+					start = nextFree(blockEnd);
+					continue;
+				}
+
+				// See how far the free run starting here goes
+				const size_t runEnd = nextOccupied(start, start + num);
+				if (runEnd - start >= num) {
+					Slot* run = slotAt(start);
+					for (size_t i = 0; i < num; ++i)
+						unlinkFree(&run[i]);
+					markOccupied(start, num, true);
+					numAllocated += num;
+					return &run->data;
+				}
+				start = nextFree(runEnd);
 			}
-		}
 
-		// We didn't find any block that could meet our request.
-		throw std::bad_alloc();
+			// We didn't find any block that could meet our request.
+			if (!growable || num > blockCapacity())
+				throw std::bad_alloc();
+
+			// Make some room, then look again in the new block
+			start = numSlots;
+			addBlock(blockCapacity());
+		}
 	}
 
 	/**
 	 * \brief Deallocates _num_ contiguous objects staritng at the given address
 	 * \param allocated A pointer to the block of objects to deallocate
 	 * \param num The number of contiguous objects to deallocate from the pool
-	 * \warning Some verification is done to make sure that _allocated_ is
-	 *          a valid pointer to a slot in the pool, but none is made
-	 *          to ensure that this block was actually allocated, as doing so
-	 *          would be inconveniently expensive.
-	 * \todo This could be optimized for the case where we are deallocating
-	 *       a single slot.
+	 * \throws std::invalid_argument if _allocated_ is not a valid pointer to a slot in the pool
+	 * \throws std::logic_error if any slot in the block is already free
 	 *
-	 * Complexity is O(n), as we must iterate through the free list
-	 * and update it.
+	 * Complexity is O(num), as each slot is pushed onto the front of the free list.
 	 *
 	 * This function is mainly intneded for use with a PoolAllocator
 	 * and probably shouldn't be used raw.
@@ -227,41 +255,21 @@ public:
 		// We can do this since a Slot
 		Slot* blockStart = reinterpret_cast<Slot*>(allocated);
 
-		// Validation: Make sure this is a valid pointer
-		if (!isValidPointer(blockStart))
+		// Validation: Make sure this is a valid pointer, and the whole block is in the same pool block
+		const size_t start = findSlot(blockStart);
+		if (start == invalidSlot || start + num > numSlots || (start >> blockShift) != ((start + num - 1) >> blockShift))
 			throw std::invalid_argument("The provided pointer is not valid");
 
-		// If the original author sucks at indirection and you can eliminate
-		// some of the corner cases below, go nuts.
-
-		// This will be our first free node
-		if (firstFree == nullptr) {
-			blockStart[num - 1].next = nullptr;
-			firstFree = blockStart;
-		}
-		// The slot comes before our previously first free slot
-		else if (blockStart < firstFree) {
-			blockStart[num - 1].next = firstFree;
-			firstFree = blockStart;
-		}
-		// Walk the free list, inserting this block in the correct place
-		else {
-			Slot** curr = &firstFree;
-			while ((*curr)->next != nullptr && (*curr)->next < blockStart) {
-				curr = &(*curr)->next;
-			}
-			if ((*curr)->next == blockStart) {
+		for (size_t i = start; i < start + num; ++i) {
+			if (!isOccupied(i))
 				throw std::logic_error("Double deallocate detected");
-			}
-
-			blockStart[num - 1].next = (*curr)->next;
-			(*curr)->next = blockStart;
 		}
 
-		// Set up the block's "next free" pointers
-		for (size_t i = 0; i < num - 1; ++i)
-			blockStart[i].next = &blockStart[i + 1];
+		// Push the slots in reverse so that the block comes back out of construct() in order
+		for (size_t i = num; i-- > 0;)
+			pushFree(&blockStart[i]);
 
+		markOccupied(start, num, false);
 		numAllocated -= num;
 	}
 
@@ -271,12 +279,26 @@ public:
 	 * \param args Variadic template magic that forwards whatever aruments that you would pass
 	 *             to a constructor of T.
 	 * \returns a pointer to a T, allocated from the pool then constructed.
-	 * \throws std::bad_alloc if there is no room in the Pool
+	 * \throws std::bad_alloc if there is no room in the Pool and it can't grow
+	 *
+	 * Complexity is O(1) (amortized, if the pool grows).
+	 * The most recently freed slot is reused first.
 	 */
 	template <typename... Args>
 	T* construct(Args&&... args)
 	{
-		T* ret = allocate(1);
+		if (firstFree == nullptr) {
+			if (!growable)
+				throw std::bad_alloc();
+			addBlock(blockCapacity());
+		}
+
+		Slot* slot = firstFree;
+		unlinkFree(slot);
+		markOccupied(findSlot(slot), 1, true);
+		++numAllocated;
+
+		T* ret = &slot->data;
 		::new (ret) T(std::forward<Args>(args)...);
 
 		return ret;
@@ -321,7 +343,7 @@ public:
 	 * \brief Destroys then deallocates an object constructed from the pool using _construct_
 	 *        or _tryConstruct_
 	 *
-	 * Complexity is O(n). If possible, prefer the iterator version, as it is O(1)
+	 * Complexity is O(1)
 	 */
 	void destroy(T* toRelease)
 	{
@@ -334,33 +356,60 @@ public:
 	 * \brief Destroys an object from an iterator
 	 * \returns An iterator to the next element
 	 *
-	 * Coplexity is O(1), and is therefore preferable to the other destroy
+	 * Complexity is O(1), plus finding the next element
 	 */
 	iterator destroy(iterator it)
 	{
-		if (!isValidPointer(it.current))
+		if (it.pool != this || it.index >= numSlots)
 			throw std::invalid_argument("The provided iterator is not valid");
 
 		auto ret = it + 1;
+		destroy(&*it);
+		return ret;
+	}
 
-		// If the return value's "next valid" pointer is the same as
-		// the "next valid" pointer of the iterator we're destroying,
-		// we need to update the return value.
-		// Since the current slot will, in the next step, be free,
-		// the current slot's next pointer will be the return value's next pointer.
-		if (ret.nextFree == it.nextFree)
-			ret.nextFree = &it.current->next;
-
-		it->~T();
+	/**
+	 * \brief Returns the index of the slot an object from the pool lives in
+	 * \returns An index in the range [0, max_size())
+	 *
+	 * Useful for keeping per-slot data in flat arrays alongside the pool.
+	 * Complexity is O(1) for a pool that hasn't grown,
+	 * and O(log(number of blocks)) otherwise.
+	 */
+	size_t indexOf(const T* t) const
+	{
+		const size_t ret = findSlot(reinterpret_cast<const Slot*>(t));
+		assert(ret != invalidSlot);
+		return ret;
+	}
 
-		it.current->next = *it.nextFree;
-		// Yes, const_cast is nasty.
-		// But, it seems simpler than more template matamagic in the iterator
-		*const_cast<Slot**>(it.nextFree) = it.current;
+	/**
+	 * \brief Returns true if the slot with the given index holds an object
+	 *
+	 * Complexity is O(1)
+	 */
+	bool isOccupied(size_t slot) const
+	{
+		assert(slot < numSlots);
+		return (occupied[slot / bitsPerWord] >> (slot % bitsPerWord)) & 1;
+	}
 
-		--numAllocated;
+	/**
+	 * \brief Returns the object in the slot with the given index
+	 * \warning The slot must be occupied (see isOccupied)
+	 *
+	 * Complexity is O(1)
+	 */
+	T& at(size_t slot)
+	{
+		assert(isOccupied(slot));
+		return slotAt(slot)->data;
+	}
 
-		return ret;
+	const T& at(size_t slot) const
+	{
+		assert(isOccupied(slot));
+		return slotAt(slot)->data;
 	}
 
 	iterator begin() { return iterator(*this); }
@@ -369,11 +418,11 @@ public:
 
 	const_iterator cbegin() const { return const_iterator(*this); }
 
-	iterator end() { return iterator(buff + numSlots); }
+	iterator end() { return iterator(*this, numSlots); }
 
-	const_iterator end() const { return const_iterator(buff + numSlots); }
+	const_iterator end() const { return const_iterator(*this, numSlots); }
 
-	const_iterator cend() const { return const_iterator(buff + numSlots); }
+	const_iterator cend() const { return const_iterator(*this, numSlots); }
 
 	// No copy or assign
 
@@ -387,55 +436,185 @@ public:
 
 private:
 
+	union Slot;
+
+	/// The links of a free slot in the free list
+	struct FreeLinks {
+		Slot* prev;
+		Slot* next;
+	};
+
 	/// A slot in our pool.
-	/// We use this union so that we can hold a pointer to the next free slot
+	/// We use this union so that we can hold the free list's links
 	/// when the slot is not in use
 	union Slot {
 		T data; ///< The allocated data in the slot, or alternatively...
-		Slot* next; ///< ...A pointer to the next free slot
+		FreeLinks free; ///< ...Its neighbors in the free list
 	};
 
+	/// Pushes a slot onto the front of the free list
+	void pushFree(Slot* s)
+	{
+		s->free.prev = nullptr;
+		s->free.next = firstFree;
+		if (firstFree != nullptr)
+			firstFree->free.prev = s;
+		firstFree = s;
+	}
+
+	/// Removes a slot from wherever it is in the free list
+	void unlinkFree(Slot* s)
+	{
+		if (s->free.prev == nullptr) {
+			assert(firstFree == s);
+			firstFree = s->free.next;
+		}
+		else {
+			s->free.prev->free.next = s->free.next;
+		}
+
+		if (s->free.next != nullptr)
+			s->free.next->free.prev = s->free.prev;
+	}
+
+	/// Returns the index of the first occupied slot in [from, limit), or _limit_ if there is none
+	size_t nextOccupied(size_t from, size_t limit) const
+	{
+		return findBit(from, limit, 0);
+	}
+
+	/// Returns the index of the first free slot at or after _from_, or max_size() if there is none
+	size_t nextFree(size_t from) const
+	{
+		return findBit(from, numSlots, ~uint64_t(0));
+	}
+
 	/**
-	 * \brief Gets the number of contiguous slots start
-	 * \param s The first free slot in a possible group of contiguous slots
-	 * \returns The number of contiguous slots, starting at the given slot,
-	 *          and the next free pointer after this current slot,
-	 *          or 0 and null if null is given as an input
-	 * \warning This function assumes that the pointer it is passed is free.
+	 * \brief Finds the first slot in [from, limit) whose occupancy bit is set,
+	 *        once each bitmap word has been XORed with _flip_
+	 * \returns The slot's index, or _limit_ if there is none
 	 */
-	std::pair<size_t, Slot**> getContiguousCount(Slot* s) const
-	{
-		if (s == nullptr)
-			return std::pair<size_t, Slot**>(0, nullptr);
-		assert(isValidPointer(s));
-		size_t contig = 1;
-		while (s->next == s + 1) {
-			++contig;
-			++s;
+	size_t findBit(size_t from, size_t limit, uint64_t flip) const
+	{
+		assert(limit <= numSlots);
+		if (from >= limit)
+			return limit;
+
+		size_t w = from / bitsPerWord;
+		uint64_t bits = (occupied[w] ^ flip) & (~uint64_t(0) << (from % bitsPerWord));
+		while (bits == 0) {
+			if (++w * bitsPerWord >= limit)
+				return limit;
+			bits = occupied[w] ^ flip;
 		}
 
-		return std::pair<size_t, Slot**>(contig, &s->next);
+		return std::min(w * bitsPerWord + __builtin_ctzll(bits), limit);
 	}
 
-	/// \brief Checks if a pointer is within the range of the buffer and is aligned.
-	/// \warning This does not check if the pointer is free or used. That would take too much time.
-	bool isValidPointer(Slot* s) const
+	/// Sets or clears the occupancy bits for _num_ slots, starting at index _start_
+	void markOccupied(size_t start, size_t num, bool value)
 	{
-		if (s < buff || s >= buff + numSlots)
-			return false; // The pointer is not inside our buffer
+		for (size_t i = start; i < start + num; ++i) {
+			const uint64_t bit = uint64_t(1) << (i % bitsPerWord);
+			if (value)
+				occupied[i / bitsPerWord] |= bit;
+			else
+				occupied[i / bitsPerWord] &= ~bit;
+		}
+	}
+
+	/// Returns the smallest _s_ such that 2^s >= n
+	static size_t shiftFor(size_t n)
+	{
+		size_t s = 0;
+		while ((size_t(1) << s) < n)
+			++s;
+		return s;
+	}
 
-		const uintptr_t distance = (char*)s - (char*)buff;
+	/// The number of slots in each block of a growable pool
+	size_t blockCapacity() const { return size_t(1) << blockShift; }
 
+	/// Allocates another block of _slots_ slots and adds them to the free list
+	void addBlock(size_t slots)
+	{
+		assert(slots <= blockCapacity());
+		// A pool that can't grow only ever has its first block
+		assert(blocks.empty() || growable);
+
+		// Make room in our bookkeeping first so that we don't leak the block if that throws
+		blocks.reserve(blocks.size() + 1);
+		blocksByAddress.reserve(blocks.size() + 1);
+		occupied.resize((numSlots + slots + bitsPerWord - 1) / bitsPerWord, 0);
+
+		Slot* block = static_cast<Slot*>(malloc(slots * sizeof(Slot)));
+		if (block == nullptr)
+			throw std::bad_alloc();
+
+		const std::pair<const Slot*, size_t> entry(block, blocks.size());
+		blocks.emplace_back(block);
+		blocksByAddress.insert(std::upper_bound(blocksByAddress.begin(), blocksByAddress.end(), entry,
+		                                        [](const std::pair<const Slot*, size_t>& a,
+		                                           const std::pair<const Slot*, size_t>& b) {
+		                                            return std::less<const Slot*>()(a.first, b.first);
+		                                        }),
+		                       entry);
+		numSlots += slots;
+
+		// Push the slots in reverse so that a fresh block hands out its slots in order.
+		for (size_t i = slots; i-- > 0;)
+			pushFree(&block[i]);
+	}
+
+	/// Returns the slot with the given index
+	Slot* slotAt(size_t slot) const
+	{
+		assert(slot < numSlots);
+		return blocks[slot >> blockShift] + (slot & (blockCapacity() - 1));
+	}
+
+	/// Returned by findSlot for pointers that aren't to one of our slots
+	static const size_t invalidSlot = static_cast<size_t>(-1);
+
+	/// \brief Returns the index of the slot a pointer points to,
+	///        or invalidSlot if it isn't inside one of our blocks or isn't aligned to a slot.
+	/// \warning This does not check if the pointer is free or used. That would take too much time.
+	size_t findSlot(const Slot* s) const
+	{
+		// Find the last block starting at or before s
+		const std::less<const Slot*> before;
+		auto it = std::upper_bound(blocksByAddress.begin(), blocksByAddress.end(), s,
+		                           [&](const Slot* p, const std::pair<const Slot*, size_t>& b) {
+		                               return before(p, b.first);
+		                           });
+		if (it == blocksByAddress.begin())
+			return invalidSlot; // The pointer is before all of our blocks
+		--it;
+
+		const Slot* block = it->first;
+		const size_t blockSize = growable ? blockCapacity() : numSlots;
+		if (!before(s, block + blockSize))
+			return invalidSlot; // The pointer is not inside this block
+
+		const uintptr_t distance = (const char*)s - (const char*)block;
 		if (distance % sizeof(Slot) != 0)
-			return false; // The pointer is not aligned
+			return invalidSlot; // The pointer is not aligned
 
-		return true;
+		return (it->second << blockShift) + distance / sizeof(Slot);
 	}
 
-	Slot* buff; ///< The buffer for the entire pool
-	Slot* firstFree; ///< A pointer to the first free slot in the pool
-	size_t numSlots; ///< The total number of slots in the pool
+	std::vector<Slot*> blocks; ///< Our blocks of slots, in the order they were allocated
+	/// Each block's address and its position in _blocks_, sorted by address (see findSlot)
+	std::vector<std::pair<const Slot*, size_t>> blocksByAddress;
+	size_t blockShift; ///< log2 of the number of slots in each block (see slotAt)
+	bool growable; ///< True if we allocate more blocks when we run out of slots
+	Slot* firstFree; ///< The front of the (unordered) list of free slots
+	size_t numSlots; ///< The total number of slots in all of our blocks
 	size_t numAllocated; ///< The number of allocated slots in the pool
+
+	static const size_t bitsPerWord = 64;
+
+	std::vector<uint64_t> occupied; ///< One bit per slot, set if the slot holds an object
 };
 
 /// An extremely simple allocator for a Pool of type T
@@ -462,11 +641,13 @@ public:
 
 /**
  * \brief A simple forward iterator that lets us iterate through a pool's used slots
- * \warning This iterator is invalidated if slots before the current iterator
- *          are added or removed.
+ * \warning This iterator is invalidated if the slot it points to is removed,
+ *          except by destroy(iterator).
  *          In short, don't add to the pool while iterating through it,
  *          and only remove using destroy(iterator)
  *
+ * The iterator finds the next used slot using the pool's occupancy bitmap.
+ *
  * If you're perplexed by all the `std::remove_const<T>` nonsense,
  * it is so we can have const and non-const iterators.
  * In C++, the standard library containers offer both:
@@ -492,30 +673,31 @@ class PoolIterator : public std::iterator<std::forward_iterator_tag, T> {
 public:
 	friend class Pool<typename std::remove_const<T>::type>;
 
+	typedef Pool<typename std::remove_const<T>::type> PoolType;
+
 	/// Default copy constructor - just copy the members
 	PoolIterator(const PoolIterator&) = default;
 
 	/// Creates an iterator that starts at the first used slot in a pool
-	PoolIterator(const Pool<typename std::remove_const<T>::type>& pool) :
-		current(pool.buff),
-		nextFree(&pool.firstFree)
-	{
-		// If our current slot is a free node, keep incrementing until it is not.
-		while (current == *nextFree) {
-			++current;
-			nextFree = &(*nextFree)->next;
-		}
+	PoolIterator(const PoolType& pool) :
+		pool(&pool),
+		index(pool.nextOccupied(0, pool.numSlots)),
+		current(nullptr)
+	{
+		seek();
 	}
 
-	/// Creates an iterator for the Pool::end family of functions
-	PoolIterator(typename Pool<typename std::remove_const<T>::type>::Slot* end) :
-		current(end),
-		nextFree(nullptr)
+	/// Creates an iterator at the slot with the given index (used by the Pool::end family of functions)
+	PoolIterator(const PoolType& pool, size_t slot) :
+		pool(&pool),
+		index(slot),
+		current(nullptr)
 	{
+		seek();
 	}
 
 	/// Iterators must be default-constructible
-	PoolIterator() : current(nullptr), nextFree(nullptr) { }
+	PoolIterator() : pool(nullptr), index(0), current(nullptr) { }
 
 	// Common iterator operators.
 	// Iterators act like pointers to their current item and can be dereferenced
@@ -528,7 +710,7 @@ public:
 	/// Equality. Two iterators are true if they are pointing at the same item.
 	bool operator==(const PoolIterator& o) const
 	{
-		return current == o.current;
+		return pool == o.pool && index == o.index;
 	}
 
 	bool operator!=(const PoolIterator& o) const
@@ -539,23 +721,16 @@ public:
 	/// Comparison operator, needed for all forward iterators
 	bool operator<(const PoolIterator& o) const
 	{
-		assert(current != nullptr);
-		assert(o.current != nullptr);
-		return current < o.current;
+		assert(pool != nullptr);
+		assert(pool == o.pool);
+		return index < o.index;
 	}
 
 	/// Pre-increment
 	PoolIterator& operator++()
 	{
-		// Increment the current pointer
-		++current;
-
-		// If our current slot is a free node, keep incrementing until it is not.
-		while (current == *nextFree) {
-			++current;
-			nextFree = &(*nextFree)->next;
-		}
-
+		index = pool->nextOccupied(index + 1, pool->numSlots);
+		seek();
 		return *this;
 	}
 
@@ -586,7 +761,11 @@ public:
 
 private:
 
+	/// Points _current_ at the slot at _index_, or null if we're at the end
+	void seek() { current = index < pool->numSlots ? pool->slotAt(index) : nullptr; }
+
+	const PoolType* pool; ///< The pool we're iterating through
+	size_t index; ///< The index of the slot we're currently at
 	// gcc tells me I need to use "typename". Huh. Okay.
-	typename Pool<typename std::remove_const<T>::type>::Slot* current;
-	typename Pool<typename std::remove_const<T>::type>::Slot* const* nextFree;
+	typename PoolType::Slot* current; ///< The slot we're currently at
 };
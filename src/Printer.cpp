@@ -1,6 +1,8 @@
 #include "Printer.hpp"
 
+#include <algorithm>
 #include <cstdio>
+#include <string>
 
 #include "Peer.hpp"
 
@@ -8,6 +10,10 @@ namespace {
 
 bool machineOutput = false;
 
+// How big the human-readable histogram gets
+const size_t histogramRows = 20;
+const size_t histogramWidth = 50;
+
 }
 
 void printMachineOutput(bool forMachines)
@@ -23,6 +29,14 @@ void printTick(int tickNum)
 	printf("t %d\n", tickNum);
 }
 
+void printSeed(unsigned long long seed)
+{
+	if (!machineOutput)
+		return;
+
+	printf("r %llu\n", seed);
+}
+
 void printConnection(const Peer& p)
 {
 	if (machineOutput)
@@ -54,3 +68,48 @@ void printFinished(int id, size_t totalChunks)
 	else
 		printf("Peer %d finished (%zu total chunks)\n", id, totalChunks);
 }
+
+void printHistogram(const std::vector<size_t>& completions)
+{
+	if (machineOutput) {
+		for (size_t tick = 0; tick < completions.size(); ++tick) {
+			if (completions[tick] > 0)
+				printf("h %zu %zu\n", tick, completions[tick]);
+		}
+		return;
+	}
+
+	// Lump ticks together so that the whole thing fits in a screen
+	const size_t ticksPerRow = std::max<size_t>(1, (completions.size() + histogramRows - 1) / histogramRows);
+	std::vector<size_t> rows;
+	for (size_t tick = 0; tick < completions.size(); ++tick) {
+		if (tick % ticksPerRow == 0)
+			rows.emplace_back(0);
+		rows.back() += completions[tick];
+	}
+
+	const size_t tallest = rows.empty() ? 0 : *std::max_element(rows.begin(), rows.end());
+
+	printf("Peers finished by tick:\n");
+	for (size_t r = 0; r < rows.size(); ++r) {
+		const size_t first = r * ticksPerRow;
+		const size_t last = std::min(first + ticksPerRow, completions.size()) - 1;
+		const size_t bar = tallest == 0 ? 0 : (rows[r] * histogramWidth + tallest - 1) / tallest;
+		printf("%5zu-%-5zu | %-*s %zu\n", first, last, (int)histogramWidth, std::string(bar, '#').c_str(), rows[r]);
+	}
+}
+
+void printSummary(const char* what, uint64_t made, uint64_t sent, int ticks, double seconds)
+{
+	const uint64_t wasted = made > sent ? made - sent : 0;
+	if (machineOutput) {
+		printf("s %llu %llu %d %f\n", (unsigned long long)made, (unsigned long long)wasted, ticks, seconds);
+		return;
+	}
+
+	printf("Made %llu %s to send %llu chunks (%llu wasted, %.1f%%)\n",
+	       (unsigned long long)made, what, (unsigned long long)sent, (unsigned long long)wasted,
+	       made == 0 ? 0.0 : 100.0 * wasted / made);
+	printf("Ran %d ticks in %.3f seconds (%.1f ticks per second)\n",
+	       ticks, seconds, seconds > 0 ? ticks / seconds : 0.0);
+}
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <cstddef> // for size_t
+#include <cstdint>
+#include <vector>
 
 class Peer;
 
@@ -8,6 +10,9 @@ void printMachineOutput(bool forMachines);
 
 void printTick(int tickNum);
 
+/// Prints the seed the run was started with (for machines; people get it at the end of the run)
+void printSeed(unsigned long long seed);
+
 void printConnection(const Peer& p);
 
 void printDisconnection(int id);
@@ -15,3 +20,10 @@ void printDisconnection(int id);
 void printTransmit(int from, size_t chunk, int to);
 
 void printFinished(int id, size_t totalChunks);
+
+/// Prints how many peers finished on each tick (indexed by tick)
+void printHistogram(const std::vector<size_t>& completions);
+
+/// Prints how many offers (or requests, as named by _what_) were made, how many chunks were sent,
+/// and how fast the run went
+void printSummary(const char* what, uint64_t made, uint64_t sent, int ticks, double seconds);
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+/**
+ * \brief The Philox4x32-10 counter-based random number generator
+ *
+ * See Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3" (SC '11).
+ * Instead of stepping some internal state from one number to the next,
+ * Philox scrambles a 128-bit counter with a 64-bit key through ten rounds of multiplies and XORs.
+ * Every (key, counter) pair gives an independent block of four 32-bit numbers,
+ * so any block can be computed on its own, by any thread, in any order.
+ */
+namespace Philox {
+
+typedef std::array<uint32_t, 4> Counter;
+typedef std::array<uint32_t, 2> Key;
+
+/// Returns the block of random numbers for a given counter and key
+inline Counter block(Counter ctr, Key key)
+{
+	for (int round = 0; round < 10; ++round) {
+		const uint64_t p0 = (uint64_t)0xD2511F53 * ctr[0];
+		const uint64_t p1 = (uint64_t)0xCD9E8D57 * ctr[2];
+		ctr = {{ (uint32_t)(p1 >> 32) ^ ctr[1] ^ key[0], (uint32_t)p1,
+		         (uint32_t)(p0 >> 32) ^ ctr[3] ^ key[1], (uint32_t)p0 }};
+		// Bump the key by the golden ratio and sqrt(3) - 1 (Weyl sequences) for the next round
+		key[0] += 0x9E3779B9;
+		key[1] += 0xBB67AE85;
+	}
+	return ctr;
+}
+
+} // end namespace Philox
+
+/**
+ * \brief The random numbers one peer draws for one purpose in one tick
+ *
+ * A stream is keyed by the simulation's seed, and its counter is made of the peer's slot,
+ * the tick, and what the numbers are for. The last word of the counter counts up through the stream.
+ * Since a stream depends on nothing but those, a peer's draws are the same
+ * no matter which thread makes them or what any other peer drew first,
+ * which is what lets a seeded run come out the same regardless of thread count.
+ *
+ * Streams are cheap to make (a couple of words of state) and meet the requirements of
+ * UniformRandomBitGenerator, so they can be handed straight to the standard distributions.
+ */
+class RandomStream {
+public:
+
+	/// What a stream's numbers are for, so that different uses never share numbers
+	enum class Purpose : uint32_t {
+		setup, ///< Choosing a peer's rates when the swarm is created
+		connect, ///< Picking a peer's first neighbors as it connects
+		away, ///< Deciding how long a peer stays away, as it leaves (or is created)
+		session, ///< Deciding how long a peer stays connected, as it connects
+		periodic ///< Finding new neighbors and picking who to optimistically unchoke
+	};
+
+	typedef uint32_t result_type;
+
+	RandomStream(uint64_t seed, size_t peer, uint32_t tick, Purpose purpose) :
+		key({{ (uint32_t)seed, (uint32_t)(seed >> 32) }}),
+		counter({{ (uint32_t)peer, tick, (uint32_t)purpose, 0 }}),
+		buffered(),
+		used(4)
+	{ }
+
+	static constexpr result_type min() { return 0; }
+
+	static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+	result_type operator()()
+	{
+		// Each block gives us four numbers
+		if (used == 4) {
+			buffered = Philox::block(counter, key);
+			++counter[3];
+			used = 0;
+		}
+		return buffered[used++];
+	}
+
+private:
+	Philox::Key key;
+	Philox::Counter counter; ///< The counter for the next block
+	Philox::Counter buffered; ///< The current block
+	size_t used; ///< How many numbers of _buffered_ have been handed out
+};
@@ -0,0 +1,68 @@
+#include "RarityIndex.hpp"
+
+using namespace std;
+
+const uint32_t RarityIndex::none;
+
+void RarityIndex::reset(size_t numChunks, size_t maxPopularity)
+{
+	assert(numChunks < none);
+	next.assign(numChunks, none);
+	prev.assign(numChunks, none);
+	heads.assign(maxPopularity + 1, none);
+	tails.assign(maxPopularity + 1, none);
+}
+
+void RarityIndex::clear()
+{
+	next.clear();
+	next.shrink_to_fit();
+	prev.clear();
+	prev.shrink_to_fit();
+	heads.clear();
+	heads.shrink_to_fit();
+	tails.clear();
+	tails.shrink_to_fit();
+}
+
+void RarityIndex::insert(size_t chunk, size_t popularity)
+{
+	assert(chunk < next.size());
+
+	if (popularity >= heads.size()) {
+		heads.resize(popularity + 1, none);
+		tails.resize(popularity + 1, none);
+	}
+
+	const uint32_t c = (uint32_t)chunk;
+	next[c] = none;
+	prev[c] = tails[popularity];
+	if (tails[popularity] == none)
+		heads[popularity] = c;
+	else
+		next[tails[popularity]] = c;
+	tails[popularity] = c;
+}
+
+void RarityIndex::unlink(size_t chunk, size_t popularity)
+{
+	assert(chunk < next.size());
+	assert(popularity < heads.size());
+
+	const uint32_t c = (uint32_t)chunk;
+	if (prev[c] == none) {
+		assert(heads[popularity] == c);
+		heads[popularity] = next[c];
+	}
+	else {
+		next[prev[c]] = next[c];
+	}
+
+	if (next[c] == none) {
+		assert(tails[popularity] == c);
+		tails[popularity] = prev[c];
+	}
+	else {
+		prev[next[c]] = prev[c];
+	}
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+/**
+ * \brief Buckets the chunks a peer has by their popularity, so they can be walked rarest-first
+ *
+ * Popularity (the number of neighbors that have a chunk) is a small integer
+ * bounded by the size of the interestedList,
+ * so instead of sorting our chunks by popularity every time we make offers,
+ * we keep one list per popularity value and move chunks between lists as their counts change.
+ *
+ * The lists are intrusive and doubly linked through per-chunk next/prev indices,
+ * so inserting a chunk or moving it to another bucket is O(1),
+ * and walking the chunks rarest-first is O(number of buckets + chunks visited).
+ * New chunks go on the end of their bucket, so within a bucket, chunks are
+ * visited in the order they were added.
+ */
+class RarityIndex {
+public:
+
+	/// A position in the index. Chunks are visited from rarest to most popular.
+	struct Cursor {
+		size_t bucket; ///< The bucket (popularity) we're currently in
+		uint32_t chunk; ///< The current chunk, or RarityIndex::none if we're past the end
+
+		bool atEnd() const { return chunk == none; }
+	};
+
+	static const uint32_t none = std::numeric_limits<uint32_t>::max();
+
+	RarityIndex() : next(), prev(), heads(), tails() { }
+
+	/// Sets the index up to hold chunks of a torrent with _numChunks_ chunks,
+	/// with popularities up to _maxPopularity_ (though it will grow past this if needed).
+	/// The index starts empty.
+	void reset(size_t numChunks, size_t maxPopularity);
+
+	/// Frees the index's memory
+	void clear();
+
+	/// Adds a chunk to the end of the bucket for _popularity_
+	void insert(size_t chunk, size_t popularity);
+
+	/// Moves a chunk from one bucket to another
+	void relocate(size_t chunk, size_t from, size_t to)
+	{
+		unlink(chunk, from);
+		insert(chunk, to);
+	}
+
+	/// Returns a cursor to the rarest chunk in the index
+	Cursor first() const
+	{
+		Cursor c = { 0, none };
+		seekBucket(c);
+		return c;
+	}
+
+	/// Moves the cursor to the next chunk, rarest first
+	void advance(Cursor& c) const
+	{
+		assert(!c.atEnd());
+		c.chunk = next[c.chunk];
+		if (c.chunk == none) {
+			++c.bucket;
+			seekBucket(c);
+		}
+	}
+
+private:
+
+	/// Removes a chunk from the bucket for _popularity_
+	void unlink(size_t chunk, size_t popularity);
+
+	/// Moves the cursor to the first chunk of the first non-empty bucket at or after c.bucket
+	void seekBucket(Cursor& c) const
+	{
+		for (; c.bucket < heads.size(); ++c.bucket) {
+			if (heads[c.bucket] != none) {
+				c.chunk = heads[c.bucket];
+				return;
+			}
+		}
+		c.chunk = none;
+	}
+
+	std::vector<uint32_t> next; ///< For each chunk, the next chunk in its bucket
+	std::vector<uint32_t> prev; ///< For each chunk, the previous chunk in its bucket
+	std::vector<uint32_t> heads; ///< The first chunk of each bucket
+	std::vector<uint32_t> tails; ///< The last chunk of each bucket
+};
@@ -1,19 +1,51 @@
 #include "Simulator.hpp"
 
 #include <algorithm>
+#include <atomic>
 
-#include "IteratorUtils.hpp"
 #include "Printer.hpp"
 
 using namespace std;
 
-Simulator::Simulator(size_t numClients, size_t numChunks, double joinProbability, double leaveProbability,
-                     std::pair<int, int> uploadRange, std::pair<int, int> downloadRange, size_t freeriders) :
-	connected(numClients),
-	disconnected(numClients),
-	rng(random_device()()), // Seed the RNG with entropy from the system via random_device
-	shouldConnect(joinProbability), // Connect at a 2% rate. Feel free to play with this
-	shouldDisconnect(leaveProbability) // Disconnect at a 80% rate when done. Feel free to play with this.
+namespace {
+
+/// How many peers the store makes room for at a time as the swarm grows
+const size_t peerBlockSize = 4096;
+
+/// Peers with fewer neighbors than this look for more every tick
+const size_t minimumNeighbors = 20;
+
+// How often (in ticks) peers do each of their tasks
+
+const uint64_t reorderPeriod = 10;
+const uint64_t unchokePeriod = 30;
+const uint64_t churnPeriod = 120;
+
+} // end anonymous namespace
+
+Simulator::Simulator(size_t numClients, size_t numChunks, const ChurnModel& churn,
+                     std::pair<int, int> uploadRange, std::pair<int, int> downloadRange, size_t freeriders,
+                     uint64_t seed, Exchange exchange, size_t threads, size_t grainSize) :
+	workers(threads, grainSize),
+	peers(min(numClients, peerBlockSize)),
+	offers(workers.size()),
+	requests(workers.size()),
+	reservedAny(false),
+	justFinished(workers.size()),
+	listingChanges(workers.size()),
+	completions(1, 0),
+	exchange(exchange),
+	seed(seed),
+	churn(churn),
+	arrivals(),
+	departures(),
+	tasks(),
+	dueTasks(),
+	duePeers(),
+	arriving(),
+	departing(),
+	leaving(),
+	losingNeighbors()
 {
 	assert(numClients > 1); // Don't be stupid.
 
@@ -22,18 +54,39 @@ Simulator::Simulator(size_t numClients, size_t numChunks, double joinProbability
 
 	static int uid = 0;
 
+	// Peers are added in order, so each one's rates come from the stream for the slot it's about to get.
+	auto setupFor = [&]() {
+		return RandomStream(seed, peers.size(), 0, RandomStream::Purpose::setup);
+	};
+
 	printTick(0);
 
 	// Start out with one seeder with all the file chunks
-	auto seeder = connected.construct(uid++, upload(rng), download(rng), numChunks, true);
-	printConnection(*seeder);
+	auto gen = setupFor();
+	auto& seeder = peers.add(true, uid++, upload(gen), download(gen), numChunks, true);
+	printConnection(seeder);
+	startTasks(seeder, 1);
 
 	// Start out with everyone else with nothing
-	for (size_t i = 0; i < numClients - 1 - freeriders; ++i)
-		disconnected.construct(uid++, upload(rng), download(rng), numChunks, false);
+	for (size_t i = 0; i < numClients - 1 - freeriders; ++i) {
+		gen = setupFor();
+		peers.add(false, uid++, upload(gen), download(gen), numChunks, false);
+	}
 	// Add our freeriders in at the end
-	for (size_t i = 0; i < freeriders; ++i)
-		disconnected.construct(uid++, 0, download(rng), numChunks, false);
+	for (size_t i = 0; i < freeriders; ++i) {
+		gen = setupFor();
+		peers.add(false, uid++, 0, download(gen), numChunks, false);
+	}
+
+	// Decide when everyone but the seeder shows up
+	for (size_t i = 0; i < peers.disconnectedCount(); ++i) {
+		Peer& p = peers.disconnectedPeer(i);
+		auto away = randomFor(p, RandomStream::Purpose::away);
+		arrivals.schedule(churn.timeAway(away), (uint32_t)peers.slotOf(p));
+	}
+
+	dueTasks.assign(peers.size(), 0);
+	leaving.assign(peers.size(), 0);
 }
 
 /**
@@ -41,262 +94,520 @@ Simulator::Simulator(size_t numClients, size_t numChunks, double joinProbability
  *
  * The process is as follows:
  *
- * 1. For each disconneted peer, determine if it is coming back.
- *    If it is, add it to the connected list
- *    - Register with tracker
- *    - Add to connected pool
- *    - Reset sim counter to 0
+ * 1. Connect each disconnected peer that is scheduled to come back this tick
+ *    - Register with tracker, picking neighbors from the peers that were already connected
+ *    - Mark it connected in the peer store
+ *    - Schedule its periodic tasks, starting this tick
+ *    - Schedule when it will leave
  *
- * 2. For reach connected peer, determine if it will leave
+ * 2. Disconnect each connected peer that is scheduled to leave this tick
  *    - Remove from tracker list, update each connected peer's list
- *    - Add it to the disconnected pool
+ *      (all at once, for everyone leaving this tick)
+ *    - Mark it disconnected in the peer store
+ *    - Schedule when it will come back
  *
- * 3. Work on connected peers
- *    - Check the sim counter. If counter % 10 == 0, re-eval top 4 peers
+ * 3. Work on the connected peers that have tasks due (see runTasks())
+ *    - If number in chunklist < 20, get more peers randomly (up to 40)
+ *    - Every 10 ticks since connecting, re-eval top 4 peers
  *      - Reorder list of connected peers
  *      - Empty history structure (who we've gotten data from)
- *    - If counter % 30 == 0, optimally unchoke a peer
- *    - If number in chunklist < 20, get more peers randomly (up to 40)
+ *    - Every 30 ticks, optimally unchoke a peer
+ *    - Every 120 ticks, replace peers we can't help
  *
  * 4. Generate a list of offers for each peer,
  *    based on the upload rates of those offering and how many they are offering to.
  *
  * 5. Have each peer accept as many of its offers as possible,
  *    based on its download rate. Update the chunk lists accordingly.
+ *    Each peer then updates its chunk popularity counts with the chunks its
+ *    neighbors just received.
+ *
+ * When exchanging by request, steps 4 and 5 are replaced by each peer asking the peers
+ * that unchoke it for chunks, up to its download rate, and each uploader granting
+ * as many of those requests as its upload rate allows.
  */
 void Simulator::tick()
 {
 	printTick(++tickNumber);
+	completions.emplace_back(0);
 	connectPeers();
-	periodicTasks();
-	bumpSimCount();
-	auto offers = makeOffers();
-	considerOffers(offers);
-	acceptOffers();
-	disconnectPeers();
-}
+	collectDueTasks();
 
-bool Simulator::allDone() const
-{
-	return all_of(begin(connected), end(connected), [](const Peer& p) { return p.hasEverything(); })
-		&& all_of(begin(disconnected), end(disconnected), [](const Peer& p) { return p.hasEverything(); });
+	// Steps 3 through 5 are one job for our workers (see runPhases())
+	offers.clear();
+	requests.clear();
+	workers.run([this](size_t worker) {
+		runPhases(worker);
+	});
+
+	scheduleTasks();
+	disconnectPeers();
 }
 
 void Simulator::connectPeers()
 {
-	// Go through the disconnected peers, connecting some at random
-	for (auto it = begin(disconnected); it != end(disconnected);) {
-		if (shouldConnect(rng)) {
-			printConnection(*it);
+	// Find out who's due to show up this tick
+	arrivals.advance([this](uint32_t slot) {
+		assert(!peers.isConnected(peers.at(slot)));
+		arriving.emplace_back(slot);
+	});
+
+	// Each arriving peer sets itself up and picks its first neighbors from the peers already here.
+	// That only changes the arriving peer, so they can all do it at once.
+	// Their new neighbors find out who picked them once everyone is done.
+	workers.parallelFor(arriving.size(), [this](size_t worker, size_t first, size_t last) {
+		for (size_t i = first; i < last; ++i) {
+			Peer& p = peers.at(arriving[i]);
 			// Initialize it
-			it->simCounter = 0; // sim counter gets reset
+			p.onConnect();
 			// Get us some peers
 			// We are not interested in ourselves
-			auto peerList = getRandomPeers(Peer::desiredPeerCount, {&(*it)});
-			assert(it->interestedList.empty()); // This had better be empty
-			// Convert our Peer* list to a pair<Peer*, int> list
-			transform(begin(peerList), end(peerList), back_inserter(it->interestedList),
-			          [](Peer* p) {
-				return pair<Peer*, int>(p, 0);
-			});
-
-			// Move the peer to the connected list
-			connected.construct(std::move(*it));
-
-			// Then remove it from the disconnected list
-			it = disconnected.destroy(it);
+			auto gen = randomFor(p, RandomStream::Purpose::connect);
+			auto peerList = getRandomPeers(Peer::desiredPeerCount, {peers.handleOf(p)}, gen);
+			for (PeerHandle neighbor : peerList)
+				p.addNeighbor(neighbor, peers, listingChanges[worker]);
+		}
+	});
+	applyListingChanges();
+
+	// Then connect them all, in the order they showed up
+	for (uint32_t slot : arriving) {
+		Peer& p = peers.at(slot);
+		printConnection(p);
+
+		peers.connect(p);
+		startTasks(p, tickNumber);
+
+		// Decide when it's leaving. This can be the end of this very tick.
+		if (churn.peersLeave()) {
+			auto session = randomFor(p, RandomStream::Purpose::session);
+			departures.schedule(tickNumber + churn.timeConnected(session), slot);
 		}
-		else
-			++it;
 	}
+	arriving.clear();
 }
 
 void Simulator::disconnectPeers()
 {
-	for (auto it = begin(connected); it != end(connected);) {
-		// Our original seeder never disconnects
-		if (it->IPAddress != 0 && shouldDisconnect(rng)) {
-			printDisconnection(it->IPAddress);
-
-			it->onDisconnect();
-
-			disconnected.construct(std::move(*it));
+	// Find out who's due to leave this tick.
+	// Our original seeder never disconnects, so it's never scheduled to.
+	departures.advance([this](uint32_t slot) {
+		Peer& p = peers.at(slot);
+		assert(peers.isConnected(p));
+		assert(p.IPAddress != 0);
+
+		printDisconnection(p.IPAddress);
+		leaving[slot] = 1;
+		departing.emplace_back(slot);
+	});
 
-			it = connected.destroy(it);
+	// Everyone who lists a departing peer is about to lose a neighbor,
+	// unless they're leaving too. Sort them so we visit each once.
+	for (uint32_t slot : departing) {
+		for (uint32_t lister : peers.at(slot).listedBy) {
+			if (!leaving[lister])
+				losingNeighbors.emplace_back(lister);
 		}
-		else {
-			++it;
+	}
+	sort(begin(losingNeighbors), end(losingNeighbors));
+	losingNeighbors.erase(unique(begin(losingNeighbors), end(losingNeighbors)), end(losingNeighbors));
+
+	// Each of those peers drops its departing neighbors, and each departing peer lets go of its own.
+	// Neither touches anyone else (the departing peers' chunks stay put), so it can all happen at once.
+	const size_t listers = losingNeighbors.size();
+	workers.parallelFor(listers + departing.size(), [&](size_t worker, size_t first, size_t last) {
+		for (size_t i = first; i < last; ++i) {
+			if (i < listers)
+				peers.at(losingNeighbors[i]).dropNeighbors(leaving, peers);
+			else
+				peers.at(departing[i - listers]).onDisconnect(leaving, peers, listingChanges[worker]);
 		}
+	});
+	applyListingChanges();
+
+	// Those that dropped below the minimum need to find more next tick.
+	for (uint32_t lister : losingNeighbors) {
+		const Peer& p = peers.at(lister);
+		if (p.interestedList.size() < minimumNeighbors)
+			tasks.schedule(tickNumber + 1, { peers.handleOf(p), findNeighbors });
 	}
+	losingNeighbors.clear();
+
+	for (uint32_t slot : departing) {
+		Peer& p = peers.at(slot);
+		peers.disconnect(p);
+		leaving[slot] = 0;
+
+		// Decide when it's coming back
+		auto away = randomFor(p, RandomStream::Purpose::away);
+		arrivals.schedule(tickNumber + churn.timeAway(away), slot);
+	}
+	departing.clear();
 }
 
-std::vector<Peer*> Simulator::getRandomPeers(size_t num,
-                                             const std::vector<Peer*>& ignore)
+std::vector<PeerHandle> Simulator::getRandomPeers(size_t num, const std::vector<PeerHandle>& ignore, RandomStream& gen)
 {
-	vector<Peer*> ret; // The one we're going to return
+	// Only peers that still need chunks are worth having as neighbors
+	vector<PeerHandle> ret; // The one we're going to return
 	ret.reserve(num);
+	peers.sampleIncomplete(num, ignore, gen, ret);
+	return ret;
+}
 
-	// If we have fewer than num connected peers, congrats.
-	// All of them are in our list
-	if (connected.size() <= num) {
-		for (Peer& connectedPeer : connected)
-			ret.emplace_back(&connectedPeer);
+void Simulator::runPhases(size_t worker)
+{
+	switch (exchange) {
+		case Exchange::offers:
+		case Exchange::reservations:
+			exchangeOffers(worker);
+			break;
+
+		case Exchange::requests:
+			exchangeRequests(worker);
+			break;
 	}
-	// No such luck. Let's get a random subset of our peers
-	else {
-		// Get pointers to all the connected peers
-		vector<Peer*> peerList;
-		peerList.reserve(connected.size());
-
-		for (Peer& connectedPeer : connected) {
-			// Ignore those that have everything
-			if (!connectedPeer.hasEverything())
-				peerList.emplace_back(&connectedPeer);
-		}
+}
 
-		// Shuffle that pointer list
-		shuffle(begin(peerList), end(peerList), rng);
+void Simulator::exchangeOffers(size_t worker)
+{
+	// Each peer does whatever tasks it has due, then makes its offers.
+	// Tasks only change the peer doing them (its neighbors find out who listed them afterwards),
+	// and offers only look at other peers' chunks, which nobody changes until everyone is done,
+	// so both can happen in one trip through the peers.
+	// Each worker gets its own offer buffer, so nobody has to wait on a lock.
+	auto& buffer = offers.buffer(worker);
+	forEachConnected([&](Peer& p) {
+		runTasks(worker, p);
+		p.makeOffers(peers.handleOf(p), peers, buffer);
+	});
 
-		// Only take the first num pointers
-		if (peerList.size() > num)
-			peerList.resize(num);
+	workers.barrier([this] {
+		applyListingChanges();
+		// Group the offers by who they're going to, using each recipient's slot in the store
+		offers.scatter(peers.capacity());
+		offersMade += offers.size();
+	});
 
-		ret = move(peerList);
+	if (exchange == Exchange::reservations) {
+		resolveOffers();
+		return;
 	}
 
-	// Remove peers we already have from the results
-	// TODO: This is n^2, but do smarter sorting or something later
-	for (Peer* conn : ignore) {
-		auto it = find(begin(ret), end(ret), conn);
-		if (it != end(ret))
-			ret.erase(it);
-	}
+	forEachConnected([&](Peer& p) {
+		const size_t idx = peers.slotOf(p);
+		p.considerOffers(offers.offersBegin(idx), offers.offersEnd(idx));
 
-	return ret;
+		const bool wasDone = p.hasEverything();
+		p.acceptOffers(peers);
+		if (!wasDone && p.hasEverything())
+			justFinished[worker].emplace_back(&p);
+	});
+
+	workers.barrier([this] {
+		// Print what was sent one peer at a time, as resolveOffers does,
+		// so that it doesn't come out interleaved between threads.
+		for (size_t i = 0; i < peers.connectedCount(); ++i) {
+			const Peer& p = peers.connectedPeer(i);
+			for (const auto& r : p.reservationsThisTick())
+				printTransmit(peers.at(r.from).IPAddress, r.chunkIdx, p.IPAddress);
+
+			// A peer that had everything to begin with won't have taken anything
+			if (p.hasEverything() && !p.reservationsThisTick().empty())
+				printFinished(p.IPAddress, p.chunkList.size());
+		}
+		recordFinishers();
+	});
+
+	// Now that everyone has their new chunks, let each peer count its neighbors' new chunks.
+	// This has to happen before anyone's interestedList changes in the next tick.
+	forEachConnected([this](Peer& p) {
+		p.syncPopularity(peers);
+	});
+}
+
+void Simulator::recordFinishers()
+{
+	// Nobody needs to pick the peers that just finished as neighbors anymore.
+	// Which worker saw who finish depends on scheduling, and the order we take them out of the
+	// incomplete list changes who gets sampled later, so go through them by slot.
+	auto& finishers = justFinished[0];
+	for (size_t w = 1; w < justFinished.size(); ++w) {
+		finishers.insert(end(finishers), begin(justFinished[w]), end(justFinished[w]));
+		justFinished[w].clear();
+	}
+	sort(begin(finishers), end(finishers), [this](const Peer* a, const Peer* b) {
+		return peers.slotOf(*a) < peers.slotOf(*b);
+	});
+	for (Peer* p : finishers)
+		finished(*p);
+	finishers.clear();
 }
 
-Simulator::OfferMap Simulator::makeOffers()
+void Simulator::resolveOffers()
 {
-	mutex mapLock;
-	OfferMap ret;
-
-	parallelForEach(begin(connected), end(connected), [&ret, &mapLock](Peer& p) {
-		auto offers = p.makeOffers();
-		lock_guard<mutex> guard(mapLock);
-		for (auto& offer : offers) {
-			ret[offer.first].emplace_back(&p, offer.second);
+	// Make the first round of reservations
+	forEachConnected([this](Peer& p) {
+		const size_t idx = peers.slotOf(p);
+		p.considerOffers(offers.offersBegin(idx), offers.offersEnd(idx));
+		p.beginReservations();
+		if (p.reserveOffers())
+			reservedAny.store(true, memory_order_relaxed);
+	});
+
+	auto nextRound = [this] {
+		anotherRound = reservedAny.exchange(false, memory_order_relaxed);
+	};
+	workers.barrier(nextRound);
+
+	// Then keep confirming and re-reserving until everyone has what they can get
+	while (anotherRound) {
+		forEachConnected([this](Peer& p) {
+			p.confirmReservations(peers);
+		});
+		workers.barrier();
+
+		forEachConnected([this](Peer& p) {
+			if (p.reserveOffers())
+				reservedAny.store(true, memory_order_relaxed);
+		});
+		workers.barrier(nextRound);
+	}
+
+	forEachConnected([](Peer& p) {
+		p.finishReservations();
+	});
+
+	workers.barrier([this] {
+		// Print what happened one peer at a time, so it comes out in the same order every run.
+		// The connected list's order only depends on the order peers came and went in,
+		// which is the same every run, so we can also take finished peers out of the incomplete list as we go.
+		for (size_t i = 0; i < peers.connectedCount(); ++i) {
+			Peer& p = peers.connectedPeer(i);
+			for (const auto& r : p.reservationsThisTick()) {
+				if (r.confirmed)
+					printTransmit(peers.at(r.from).IPAddress, r.chunkIdx, p.IPAddress);
+			}
+
+			// Nobody offers chunks to peers that already have everything,
+			// so if we made reservations, we weren't done at the start of the tick.
+			if (p.hasEverything() && !p.reservationsThisTick().empty()) {
+				printFinished(p.IPAddress, p.chunkList.size());
+				finished(p);
+			}
 		}
 	});
 
-	return ret;
+	forEachConnected([this](Peer& p) {
+		p.syncPopularity(peers);
+	});
 }
 
-void Simulator::considerOffers(OfferMap& offers)
+void Simulator::exchangeRequests(size_t worker)
 {
-	parallelForEach(begin(connected), end(connected), [&offers](Peer& p) {
-		auto it = offers.find(&p);
-		if (it == end(offers))
-			return;
+	// Peers look at who unchokes them to make their requests, so everyone's tasks need to be done first
+	forEachConnected([&](Peer& p) {
+		runTasks(worker, p);
+	});
+
+	workers.barrier([this] {
+		applyListingChanges();
+	});
+
+	auto& requestBuffer = requests.buffer(worker);
+	forEachConnected([&](Peer& p) {
+		p.makeRequests(peers.handleOf(p), peers, requestBuffer);
+	});
+
+	workers.barrier([this] {
+		// Group the requests by who they're going to, just like offers
+		requests.scatter(peers.capacity());
+		offersMade += requests.size();
+	});
 
-		// If it's in the list, carry on.
-		p.considerOffers(it->second);
+	auto& grantBuffer = offers.buffer(worker);
+	forEachConnected([&](Peer& p) {
+		const size_t idx = peers.slotOf(p);
+		p.grantRequests(peers.handleOf(p), requests.offersBegin(idx), requests.offersEnd(idx), grantBuffer);
+	});
+
+	workers.barrier([this] {
+		offers.scatter(peers.capacity());
+	});
+
+	forEachConnected([this](Peer& p) {
+		const size_t idx = peers.slotOf(p);
+		p.receiveGrants(offers.offersBegin(idx), offers.offersEnd(idx));
+	});
+
+	workers.barrier([this] {
+		// Print what happened one peer at a time, as resolveOffers does
+		for (size_t i = 0; i < peers.connectedCount(); ++i) {
+			Peer& p = peers.connectedPeer(i);
+			const size_t idx = peers.slotOf(p);
+			for (const Offer* g = offers.offersBegin(idx); g != offers.offersEnd(idx); ++g)
+				printTransmit(peers.at(g->from.index).IPAddress, g->chunkIdx, p.IPAddress);
+
+			// Peers that already have everything don't ask for anything
+			if (p.hasEverything() && offers.offersBegin(idx) != offers.offersEnd(idx)) {
+				printFinished(p.IPAddress, p.chunkList.size());
+				finished(p);
+			}
+		}
+	});
+
+	forEachConnected([this](Peer& p) {
+		p.syncPopularity(peers);
 	});
 }
 
-void Simulator::acceptOffers()
+uint64_t Simulator::chunksSent() const
 {
-	parallelForEach(begin(connected), end(connected), [](Peer& p) {
-		p.acceptOffers();
-	});
+	// Nobody ever loses a chunk, so everything anyone has but the seeder (who's in the first slot)
+	// was sent to them
+	uint64_t owned = 0;
+	for (const Peer& p : peers)
+		owned += p.chunkCount();
+	return owned - peers.at(0).chunkCount();
 }
 
-void Simulator::bumpSimCount()
+void Simulator::finished(const Peer& p)
 {
-	parallelForEach(begin(connected), end(connected), [](Peer& p) {
-		++p.simCounter;
+	// Nobody needs to pick it as a neighbor anymore
+	peers.markComplete(p);
+	++completions[tickNumber];
+}
+
+void Simulator::startTasks(const Peer& p, uint64_t when)
+{
+	const PeerHandle h = peers.handleOf(p);
+	if (p.interestedList.size() < minimumNeighbors)
+		tasks.schedule(when, { h, findNeighbors });
+	tasks.schedule(when, { h, reorder });
+	tasks.schedule(when, { h, unchoke });
+	tasks.schedule(when, { h, replaceNeighbors });
+}
+
+void Simulator::collectDueTasks()
+{
+	// Find out who has what due
+	tasks.advance([this](const PeriodicTask& t) {
+		// Skip peers that left since this was scheduled
+		if (!peers.isCurrent(t.peer))
+			return;
+
+		uint8_t& due = dueTasks[t.peer.index];
+		if (due == 0)
+			duePeers.emplace_back(t.peer.index);
+		due |= t.task;
 	});
 }
 
-void Simulator::periodicTasks()
+void Simulator::applyListingChanges()
 {
-	for (Peer& p : connected) {
-		// If we have less than 20 peers, get some more
-		if (p.interestedList.size() < 20) {
-			// First we need to get a list of peers we already have.
-			// Time for our best friend, std::transform again!
-			// We have to transform interestedLists's <Peer*, int> pairs
-			// into just Peer pointers.
-			vector<Peer*> alreadyHas;
-			transform(begin(p.interestedList), end(p.interestedList), back_inserter(alreadyHas),
-			          [](const pair<Peer*, int>& pp) {
-				return pp.first;
-			});
-
-			alreadyHas.emplace_back(&p); // We are not interested in ourselves
-
-			assert(Peer::desiredPeerCount > alreadyHas.size());
-			auto newPeers = getRandomPeers(Peer::desiredPeerCount - alreadyHas.size(), alreadyHas);
-
-			vector<pair<Peer*, int>> newPairs;
-			newPairs.reserve(newPeers.size());
-
-			transform(begin(newPeers), end(newPeers), back_inserter(newPairs), [](Peer* p) {
-				return pair<Peer*, int>(p, 0);
-			});
-
-			assert(Peer::desiredPeerCount >= p.interestedList.size() + newPairs.size());
-			p.interestedList.insert(end(p.interestedList), begin(newPairs), end(newPairs));
-		}
+	// Each worker's changes for a given peer are in the order they were made,
+	// so a neighbor that was added then dropped again is added before it's dropped.
+	for (auto& workerChanges : listingChanges) {
+		for (const auto& change : workerChanges)
+			peers.at(change.peer).updateListedBy(change);
+		workerChanges.clear();
+	}
+}
 
-		// Every 10 ticks, re-evaluate top four
-		if (p.simCounter % 10 == 0)
-			p.reorderPeers();
-
-		// Every 30 ticks, optimistically unchoke a random peer
-		if (p.simCounter % 30 == 0)
-			p.randomUnchoke(rng);
-
-		// Every so often, churn it up.
-		// Chuck out peers we can't help and replace them with new random guys
-		// This is important, and prevents us from getting "stuck" where everyone in your list
-		// already has the chunks you are offering.
-		if (p.simCounter % 120 == 0) {
-
-			// Find peers we can't help anymore
-			vector<decltype(p.interestedList)::iterator> cannotHelp;
-			for (auto it = begin(p.interestedList); it != end(p.interestedList); ++it) {
-				if (!p.hasSomethingFor(*it->first))
-					cannotHelp.emplace_back(it);
-			}
+void Simulator::scheduleTasks()
+{
+	for (uint32_t slot : duePeers) {
+		const Peer& p = peers.at(slot);
+		const PeerHandle h = peers.handleOf(p);
+		const uint8_t due = dueTasks[slot];
+		dueTasks[slot] = 0;
+
+		if (due & reorder)
+			tasks.schedule(tickNumber + reorderPeriod, { h, reorder });
+		if (due & unchoke)
+			tasks.schedule(tickNumber + unchokePeriod, { h, unchoke });
+		if (due & replaceNeighbors)
+			tasks.schedule(tickNumber + churnPeriod, { h, replaceNeighbors });
+
+		// If we couldn't find enough neighbors (or just dropped some), try again next tick
+		if (p.interestedList.size() < minimumNeighbors)
+			tasks.schedule(tickNumber + 1, { h, findNeighbors });
+	}
+	duePeers.clear();
+}
 
-			// If we can help someone, get out.
-			if (cannotHelp.size() == 0)
-				return;
+void Simulator::runTasks(size_t worker, Peer& p)
+{
+	const uint8_t due = dueTasks[peers.slotOf(p)];
+	if (due == 0)
+		return;
+
+	auto gen = randomFor(p, RandomStream::Purpose::periodic);
+	auto& changes = listingChanges[worker];
+
+	// If we have less than 20 peers, get some more
+	if ((due & findNeighbors) && p.interestedList.size() < minimumNeighbors) {
+		// First we need to get a list of peers we already have.
+		// Time for our best friend, std::transform again!
+		// We have to transform interestedLists's Neighbors
+		// into just their handles.
+		vector<PeerHandle> alreadyHas;
+		transform(begin(p.interestedList), end(p.interestedList), back_inserter(alreadyHas),
+		          [](const Peer::Neighbor& n) {
+			return n.handle();
+		});
+
+		alreadyHas.emplace_back(peers.handleOf(p)); // We are not interested in ourselves
+
+		assert(Peer::desiredPeerCount > alreadyHas.size());
+		auto newPeers = getRandomPeers(Peer::desiredPeerCount - alreadyHas.size(), alreadyHas, gen);
+
+		assert(Peer::desiredPeerCount >= p.interestedList.size() + newPeers.size());
+		for (PeerHandle newPeer : newPeers)
+			p.addNeighbor(newPeer, peers, changes);
+	}
 
-			// Don't get any peers we already have
-			vector<Peer*> alreadyHas;
-			transform(begin(p.interestedList), end(p.interestedList), back_inserter(alreadyHas),
-			          [](const pair<Peer*, int>& pp) {
-				return pp.first;
-			});
+	// Every 10 ticks, re-evaluate top four
+	if (due & reorder)
+		p.reorderPeers(peers);
+
+	// Every 30 ticks, optimistically unchoke a random peer
+	if (due & unchoke)
+		p.randomUnchoke(gen);
+
+	// Every so often, churn it up.
+	// Chuck out peers we can't help and replace them with new random guys
+	// This is important, and prevents us from getting "stuck" where everyone in your list
+	// already has the chunks you are offering.
+	if (due & replaceNeighbors) {
+
+		// Find peers we can't help anymore
+		vector<decltype(p.interestedList)::iterator> cannotHelp;
+		for (auto it = begin(p.interestedList); it != end(p.interestedList); ++it) {
+			if (!p.hasSomethingFor(peers.at(it->index)))
+				cannotHelp.emplace_back(it);
+		}
 
-			alreadyHas.emplace_back(&p);
+		// If we can help everyone, we're done with this peer.
+		if (cannotHelp.size() == 0)
+			return;
 
-			// Remove the peers we can't help
-			for (auto it = cannotHelp.rbegin(); it != cannotHelp.rend(); ++it)
-				p.interestedList.erase(*it);
+		// Don't get any peers we already have
+		vector<PeerHandle> alreadyHas;
+		transform(begin(p.interestedList), end(p.interestedList), back_inserter(alreadyHas),
+		          [](const Peer::Neighbor& n) {
+			return n.handle();
+		});
 
-			assert(Peer::desiredPeerCount > p.interestedList.size());
-			auto newPeers = getRandomPeers(Peer::desiredPeerCount - p.interestedList.size(), alreadyHas);
+		alreadyHas.emplace_back(peers.handleOf(p));
 
-			vector<pair<Peer*, int>> newPairs;
-			newPairs.reserve(newPeers.size());
+		// Remove the peers we can't help
+		for (auto it = cannotHelp.rbegin(); it != cannotHelp.rend(); ++it)
+			p.removeNeighbor(*it, peers, changes);
 
-			transform(begin(newPeers), end(newPeers), back_inserter(newPairs), [](Peer* p) {
-				return pair<Peer*, int>(p, 0);
-			});
+		assert(Peer::desiredPeerCount > p.interestedList.size());
+		auto newPeers = getRandomPeers(Peer::desiredPeerCount - p.interestedList.size(), alreadyHas, gen);
 
-			p.interestedList.insert(end(p.interestedList), begin(newPairs), end(newPairs));
-		}
+		for (PeerHandle newPeer : newPeers)
+			p.addNeighbor(newPeer, peers, changes);
 	}
 }
@@ -1,61 +1,199 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <random>
 #include <vector>
-#include <unordered_map>
 
-#include "Pool.hpp"
+#include "Churn.hpp"
+#include "OfferStore.hpp"
 #include "Peer.hpp"
+#include "PeerStore.hpp"
+#include "Random.hpp"
+#include "ThreadPool.hpp"
+#include "TimerWheel.hpp"
 
 /// The whole shebang. Holds our list of connected and disconnected peers.
 class Simulator {
 public:
 
-	/// A map that maps dest -> a list of pairs in the form of (source, chunk indices)
-	typedef std::unordered_map<Peer*, std::vector<std::pair<Peer*, std::vector<size_t>>>> OfferMap;
-
-	Simulator(size_t numClients, size_t numChunks, double joinProbability, double leaveProbability,
-	          std::pair<int, int> uploadRange, std::pair<int, int> downloadRange, size_t freeriders);
+	/// How peers decide who sends which chunks to whom each tick
+	enum class Exchange {
+		offers, ///< Uploaders make offers and receivers take what they can (see Peer::acceptOffers)
+		reservations, ///< Offers are taken in rounds, so the run doesn't depend on threads (see Peer::reserveOffers)
+		requests ///< Receivers make requests and uploaders grant what they can (see Peer::makeRequests)
+	};
+
+	/// \param churn How long peers stay connected, and how long they stay away
+	/// \param seed The seed for every random choice in the run. The same seed gives the same run.
+	/// \param exchange How chunks change hands. With Exchange::offers, which uploader slots go to whom
+	///                 depends on thread scheduling, so a seeded run is only repeatable on one thread.
+	///                 The other two give the same run on any number of threads.
+	/// \param threads The number of threads to run the simulation on, or 0 for one per hardware thread
+	/// \param grainSize The number of connected peers each worker claims at a time in the parallel phases
+	Simulator(size_t numClients, size_t numChunks, const ChurnModel& churn,
+	          std::pair<int, int> uploadRange, std::pair<int, int> downloadRange, size_t freeriders,
+	          uint64_t seed, Exchange exchange = Exchange::offers,
+	          size_t threads = 0, size_t grainSize = ThreadPool::defaultGrainSize);
 
 	void tick();
 
 	int getTickCount() const { return tickNumber; }
 
+	/// The number of threads the simulation runs on
+	size_t threadCount() const { return workers.size(); }
+
 	// Returns true when all peers have all the chunks
-	bool allDone() const;
+	bool allDone() const { return peers.allComplete(); }
+
+	/// How many peers finished downloading on each tick, indexed by tick
+	const std::vector<size_t>& completionHistogram() const { return completions; }
+
+	/// How many offers (or requests, with Exchange::requests) have been made so far
+	uint64_t offerCount() const { return offersMade; }
+
+	/// How many chunks have been sent so far. Each offer (or request) that didn't lead to one was wasted.
+	uint64_t chunksSent() const;
 
 private:
 
+	/// Connects the peers due to show up this tick. They set themselves up in parallel,
+	/// then are added to the store (and printed) in the order they arrived.
 	void connectPeers();
 
+	/// Disconnects the peers due to leave this tick. Their neighbors drop them and they drop their neighbors
+	/// in parallel, then they're taken out of the store in the order they left.
 	void disconnectPeers();
 
 	/**
-	 * Gets a map of all offers from one connected peer to another
-	 * \returns A map mapping dest -> a list of pairs in the form of (source, chunk indices)
+	 * \brief Runs steps 3 through 5 of tick() on one of our workers
+	 *
+	 * Every worker runs this at once, each taking turns claiming peers in each phase.
+	 * Phases that can't start until everyone is done with the last one are separated by
+	 * ThreadPool::barrier(), and the bits of bookkeeping that have to happen on one thread
+	 * (grouping offers, taking finished peers out of the incomplete list, printing)
+	 * are done by whichever worker gets to the barrier last.
+	 * This keeps the workers busy for the whole tick, instead of handing them a new job for every phase.
 	 */
-	OfferMap makeOffers();
+	void runPhases(size_t worker);
+
+	/// Runs tasks and makes, considers, and accepts offers (or resolves them, with Exchange::reservations)
+	void exchangeOffers(size_t worker);
+
+	/// Runs tasks, then has peers make requests, grant them, and receive their grants
+	void exchangeRequests(size_t worker);
+
+	/// Takes the peers that just finished in acceptOffers out of the incomplete list, in slot order
+	void recordFinishers();
+
+	/// Has each connected peer take its offers in rounds of reservations, so that the results
+	/// (and what we print) are the same no matter how many threads we use
+	void resolveOffers();
+
+	/// The things peers do from time to time.
+	/// These are bits, so that we can collect everything a peer has due in a tick into one byte.
+	enum Task : uint8_t {
+		findNeighbors = 1 << 0, ///< Get more neighbors if we're short
+		reorder = 1 << 1, ///< Re-evaluate the top four
+		unchoke = 1 << 2, ///< Optimistically unchoke someone
+		replaceNeighbors = 1 << 3 ///< Replace neighbors we can't help
+	};
+
+	/// A task, and who it's for. If the peer disconnects before it's due, the handle goes stale and it's dropped.
+	struct PeriodicTask {
+		PeerHandle peer;
+		Task task;
+	};
+
+	/// Finds the peers with tasks due this tick, filling in _dueTasks_ and _duePeers_
+	void collectDueTasks();
+
+	/// Lets everyone know who listed them in runTasks
+	void applyListingChanges();
+
+	/// Schedules the next round of tasks for each peer that had some due this tick
+	void scheduleTasks();
+
+	/// Records that a peer just got the last of its chunks
+	void finished(const Peer& p);
+
+	/// Does the tasks a peer has due this tick (if any), in the order they've always been done in.
+	/// Each peer only changes its own interestedList here, so peers can do their tasks in parallel.
+	void runTasks(size_t worker, Peer& p);
 
-	void considerOffers(OfferMap& offers);
+	/// Schedules a peer's first round of tasks for the given tick
+	void startTasks(const Peer& p, uint64_t when);
 
-	void acceptOffers();
+	std::vector<PeerHandle> getRandomPeers(size_t num, const std::vector<PeerHandle>& ignore, RandomStream& gen);
 
-	void bumpSimCount();
+	/// The stream of random numbers a peer draws from for the given purpose this tick
+	RandomStream randomFor(const Peer& p, RandomStream::Purpose purpose) const
+	{
+		return RandomStream(seed, peers.slotOf(p), (uint32_t)tickNumber, purpose);
+	}
 
-	void periodicTasks();
+	/// From inside runPhases(), calls f(peer) for each connected peer this worker claims.
+	/// Together, the workers visit every connected peer once.
+	template <typename F>
+	void forEachConnected(const F& f)
+	{
+		workers.share(peers.connectedCount(), [&](size_t first, size_t last) {
+			for (size_t i = first; i < last; ++i)
+				f(peers.connectedPeer(i));
+		});
+	}
 
-	std::vector<Peer*> getRandomPeers(size_t num,
-	                                  const std::vector<Peer*>& ignore = std::vector<Peer*>());
+	ThreadPool workers; ///< The threads that run the parallel parts of each tick
 
-	Pool<Peer> connected; ///< The clients who are currently connected
-	Pool<Peer> disconnected; ///< The clients who are currently disconnected
+	PeerStore peers; ///< Every client, connected or not
+
+	OfferStore offers; ///< This tick's offers (or grants, with Exchange::requests), reused from tick to tick
+
+	/// This tick's requests, with Exchange::requests. Each Offer is _from_ the peer asking for the chunk.
+	OfferStore requests;
+
+	/// Set by any worker that made a reservation this round in resolveOffers()
+	std::atomic<bool> reservedAny;
+
+	/// Whether resolveOffers() needs another round. Only written by the last worker to reach a barrier.
+	bool anotherRound = false;
+
+	/// The peers each worker saw finish in acceptOffers, so we can update _peers_ afterwards
+	std::vector<std::vector<Peer*>> justFinished;
+
+	/// The changes to listedBy each worker recorded in runTasks, to be made once everyone is done
+	std::vector<std::vector<Peer::ListingChange>> listingChanges;
 
 	int tickNumber = 0;
 
+	std::vector<size_t> completions; ///< See completionHistogram()
+
+	const Exchange exchange; ///< How chunks change hands
+
+	uint64_t offersMade = 0; ///< See offerCount()
+
 	// C++11 random number magic. See
 	// http://en.cppreference.com/w/cpp/numeric/random
 
-	std::mt19937 rng; ///< Random number generator used to get our probabilities
-	std::bernoulli_distribution shouldConnect; ///< Should the peer connect?
-	std::bernoulli_distribution shouldDisconnect; ///< Should the peer disconnect?
+	const uint64_t seed; ///< What every RandomStream we draw from is keyed by (see randomFor())
+
+	ChurnModel churn; ///< How long peers stay connected, and how long they stay away
+
+	// Each peer other than the seeder always has exactly one of these scheduled,
+	// depending on if it's connected, so each tick we only visit the peers that are coming or going.
+
+	TimerWheel<uint32_t> arrivals; ///< The slots of disconnected peers, scheduled for when they'll connect
+	TimerWheel<uint32_t> departures; ///< The slots of connected peers, scheduled for when they'll leave
+
+	TimerWheel<PeriodicTask> tasks; ///< Each connected peer's upcoming tasks
+
+	std::vector<uint8_t> dueTasks; ///< For each slot, the Task bits due this tick. Zeroed again by scheduleTasks().
+	std::vector<uint32_t> duePeers; ///< The slots with tasks due this tick, from collectDueTasks()
+
+	// Scratch space for connectPeers() and disconnectPeers(), kept around so we don't reallocate it every tick
+
+	std::vector<uint32_t> arriving; ///< The slots of the peers connecting this tick, in order
+	std::vector<uint32_t> departing; ///< The slots of the peers disconnecting this tick, in order
+	std::vector<uint8_t> leaving; ///< For each slot, nonzero if the peer is in _departing_
+	std::vector<uint32_t> losingNeighbors; ///< The slots of the peers that list someone in _departing_
 };
@@ -0,0 +1,90 @@
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+using namespace std;
+
+const size_t ThreadPool::defaultGrainSize;
+const unsigned ThreadPool::spinsBeforeYielding;
+
+ThreadPool::ThreadPool(size_t workers, size_t grainSize) :
+	numWorkers(workers != 0 ? workers : max(1u, thread::hardware_concurrency())),
+	grain(max<size_t>(grainSize, 1)),
+	threads(),
+	mutex(),
+	wake(),
+	finished(),
+	job(nullptr),
+	generation(0),
+	running(0),
+	stopping(false),
+	claimed(0),
+	arrived(0),
+	barrierGeneration(0)
+{
+	threads.reserve(numWorkers - 1);
+	for (size_t i = 1; i < numWorkers; ++i)
+		threads.emplace_back([this, i] { workerLoop(i); });
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+
+	for (auto& t : threads)
+		t.join();
+}
+
+void ThreadPool::run(const std::function<void(size_t)>& toRun)
+{
+	{
+		lock_guard<std::mutex> lock(mutex);
+		assert(running == 0); // Only one job at a time, please
+		job = &toRun;
+		running = numWorkers - 1;
+		++generation;
+		claimed.store(0, memory_order_relaxed);
+	}
+	wake.notify_all();
+
+	// Do our part
+	toRun(0);
+
+	// Wait for everyone else to finish theirs
+	unique_lock<std::mutex> lock(mutex);
+	finished.wait(lock, [this] { return running == 0; });
+	job = nullptr;
+}
+
+void ThreadPool::workerLoop(size_t worker)
+{
+	size_t lastGeneration = 0;
+
+	while (true) {
+		const function<void(size_t)>* toRun;
+		{
+			unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [&] { return stopping || generation != lastGeneration; });
+			if (stopping)
+				return;
+
+			lastGeneration = generation;
+			toRun = job;
+		}
+
+		(*toRun)(worker);
+
+		bool last;
+		{
+			lock_guard<std::mutex> lock(mutex);
+			last = --running == 0;
+		}
+		if (last)
+			finished.notify_one();
+	}
+}
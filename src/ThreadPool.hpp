@@ -0,0 +1,156 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * \brief A fixed set of worker threads that live as long as the pool does
+ *
+ * The simulator runs several parallel phases every tick.
+ * Spinning up fresh threads for each one (as `std::async` does) means creating and joining
+ * hundreds of thousands of OS threads over a long run, so instead we start our workers once
+ * and hand them a job for each phase.
+ *
+ * The thread calling run() does its share of the work as worker 0,
+ * so a pool of size 1 has no extra threads at all and runs everything inline.
+ *
+ * Per-peer work is very uneven (the seeder has far more to offer than a free rider),
+ * so parallelFor() doesn't split work into one equal slice per worker.
+ * Instead, workers repeatedly claim the next few (the grain size) items until there are none left,
+ * so nobody sits idle while one worker grinds through an expensive slice.
+ *
+ * Waking the workers for each phase and waiting for them to go back to sleep costs a trip
+ * through the mutex and condition variables every time, so a job can also run several phases itself,
+ * splitting each one up with share() and waiting for everyone to finish it with barrier().
+ * Barriers spin instead of sleeping, since phases are short and everyone shows up at about the same time.
+ */
+class ThreadPool {
+public:
+
+	/// The grain size used if none is given
+	static const size_t defaultGrainSize = 64;
+
+	/// Starts a pool of _numWorkers_ workers (including the calling thread).
+	/// Zero means one per hardware thread.
+	/// _grainSize_ is the number of items workers claim at a time in parallelFor().
+	explicit ThreadPool(size_t numWorkers = 0, size_t grainSize = defaultGrainSize);
+
+	/// Stops and joins all of the worker threads
+	~ThreadPool();
+
+	/// The number of workers, including the thread that calls run()
+	size_t size() const { return numWorkers; }
+
+	/**
+	 * \brief Runs a job on every worker, returning once all of them have finished
+	 * \param job Called once per worker with the worker's index, in [0, size())
+	 *
+	 * Only one thread should call run() at a time.
+	 */
+	void run(const std::function<void(size_t)>& job);
+
+	/// The number of items workers claim at a time in parallelFor()
+	size_t grainSize() const { return grain; }
+
+	/**
+	 * \brief Runs a function over [0, count), with workers claiming grainSize() items at a time
+	 * \param count The number of items
+	 * \param f Called as `f(worker, first, last)` for each claimed range [first, last)
+	 */
+	template <typename F>
+	void parallelFor(size_t count, const F& f)
+	{
+		std::atomic<size_t> next(0);
+		run([&](size_t worker) {
+			for (size_t first = next.fetch_add(grain); first < count; first = next.fetch_add(grain))
+				f(worker, first, std::min(first + grain, count));
+		});
+	}
+
+	/**
+	 * \brief Splits [0, count) between the workers running the current job, like parallelFor()
+	 * \param count The number of items
+	 * \param f Called as `f(first, last)` for each range [first, last) this worker claims
+	 *
+	 * Every worker of the current job must call this (with the same _count_)
+	 * and then barrier() before anyone calls share() again.
+	 * This returns once there is nothing left to claim, which may be before other workers finish theirs.
+	 */
+	template <typename F>
+	void share(size_t count, const F& f)
+	{
+		for (size_t first = claimed.fetch_add(grain); first < count; first = claimed.fetch_add(grain))
+			f(first, std::min(first + grain, count));
+	}
+
+	/// Waits for every worker running the current job to get here
+	void barrier() { barrier([] { }); }
+
+	/**
+	 * \brief Waits for every worker running the current job to get here,
+	 *        then calls _serial_ once before letting any of them go
+	 *
+	 * _serial_ runs on whichever worker arrives last, and sees everything every worker did
+	 * before arriving. Everything it does is seen by every worker after the barrier.
+	 */
+	template <typename F>
+	void barrier(const F& serial)
+	{
+		const size_t generation = barrierGeneration.load(std::memory_order_acquire);
+
+		if (arrived.fetch_add(1, std::memory_order_acq_rel) == numWorkers - 1) {
+			serial();
+			// Get ready for the next share() and barrier()
+			claimed.store(0, std::memory_order_relaxed);
+			arrived.store(0, std::memory_order_relaxed);
+			barrierGeneration.store(generation + 1, std::memory_order_release);
+			return;
+		}
+
+		for (unsigned spins = 0; barrierGeneration.load(std::memory_order_acquire) == generation; ++spins) {
+			// Let someone else have the core if we've been at this a while,
+			// in case there are more workers than cores
+			if (spins >= spinsBeforeYielding)
+				std::this_thread::yield();
+		}
+	}
+
+	// No copy or assign
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+private:
+
+	/// How many times barrier() checks if everyone's there before it starts yielding between checks
+	static const unsigned spinsBeforeYielding = 1024;
+
+	/// What each of our threads does until the pool is destroyed
+	void workerLoop(size_t worker);
+
+	const size_t numWorkers;
+
+	const size_t grain; ///< Items claimed at a time by parallelFor()
+
+	std::vector<std::thread> threads; ///< Workers 1 through numWorkers - 1
+
+	std::mutex mutex; ///< Guards everything below
+	std::condition_variable wake; ///< Signaled when there is a new job (or we're shutting down)
+	std::condition_variable finished; ///< Signaled when the last worker finishes a job
+
+	const std::function<void(size_t)>* job; ///< The current job
+	size_t generation; ///< Bumped for each job so workers know when there's a new one
+	size_t running; ///< Workers still running the current job
+	bool stopping; ///< Set when the pool is being destroyed
+
+	// These are only used by the workers running a job, and are reset as each barrier() ends
+
+	std::atomic<size_t> claimed; ///< The next item to be claimed in share()
+	std::atomic<size_t> arrived; ///< The number of workers waiting at the current barrier()
+	std::atomic<size_t> barrierGeneration; ///< Bumped as each barrier() ends
+};
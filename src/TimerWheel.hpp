@@ -0,0 +1,124 @@
+#pragma once
+
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/**
+ * \brief Holds items that are due on some future tick, handing them back when that tick comes
+ *
+ * This is a hierarchical timing wheel (see Varghese and Lauck, "Hashed and Hierarchical Timing Wheels").
+ * Each of the four levels is a ring of 256 buckets. Level 0 has a bucket for each of the next 256 ticks,
+ * level 1 has a bucket for each of the next 256 spans of 256 ticks, and so on.
+ * An item goes in the lowest level whose buckets are fine enough to tell its tick apart from the current one.
+ * When the current tick moves into a new span of a higher level, that span's bucket
+ * is emptied into the levels below it, so items trickle down until they reach level 0 on the tick they're due.
+ *
+ * Scheduling an item and taking it out when it's due are both O(1),
+ * and each item gets moved down a level at most three times, so the cost of each tick
+ * is proportional to the number of items that come due (plus a constant),
+ * not the number of items waiting.
+ *
+ * Items due on the same tick come out in the order they were scheduled.
+ */
+template <typename T>
+class TimerWheel {
+public:
+
+	/// The furthest out an item can be scheduled (about 4 billion ticks). Anything later is brought in to this.
+	static const uint64_t horizon = (1ull << 32) - (1ull << 24);
+
+	/// Creates an empty wheel whose current tick is _start_
+	explicit TimerWheel(uint64_t start = 0) : levels(), current(start), count(0), due() { }
+
+	/// The tick we're on. Items due on it have already been handed out by advance().
+	uint64_t now() const { return current; }
+
+	/// The number of items waiting
+	size_t size() const { return count; }
+
+	bool empty() const { return count == 0; }
+
+	/// Schedules an item for a tick after now()
+	void schedule(uint64_t when, T item)
+	{
+		assert(when > current);
+		if (when - current > horizon)
+			when = current + horizon;
+
+		bucketFor(when).push_back({ when, std::move(item) });
+		++count;
+	}
+
+	/// Moves on to the next tick, calling f(item) for each item due on it.
+	/// _f_ is free to schedule more items.
+	template <typename F>
+	void advance(const F& f)
+	{
+		++current;
+
+		// If we've moved into a new span at a higher level, spread out that span's items.
+		// Go from the top down, since items from higher levels can land in spans that also need spreading.
+		for (size_t level = numLevels - 1; level > 0; --level) {
+			if ((current & ((1ull << (level * bitsPerLevel)) - 1)) != 0)
+				continue;
+
+			due.clear();
+			std::swap(due, levels[level][bucketIndex(current, level)]);
+			for (auto& entry : due)
+				bucketFor(entry.when).push_back(std::move(entry));
+		}
+
+		// Everything in our level 0 bucket is due now.
+		// Swap it out first, so that f can schedule things without us tripping over them.
+		due.clear();
+		std::swap(due, levels[0][bucketIndex(current, 0)]);
+		count -= due.size();
+		for (auto& entry : due)
+			f(entry.item);
+	}
+
+private:
+
+	static const size_t bitsPerLevel = 8;
+	static const size_t bucketsPerLevel = 1 << bitsPerLevel;
+	static const size_t numLevels = 4;
+
+	/// An item, and the tick it's due on
+	struct Entry {
+		uint64_t when;
+		T item;
+	};
+
+	typedef std::vector<Entry> Bucket;
+
+	static size_t bucketIndex(uint64_t when, size_t level)
+	{
+		return (size_t)(when >> (level * bitsPerLevel)) & (bucketsPerLevel - 1);
+	}
+
+	/// Finds the bucket an item due on the given tick belongs in, based on the current tick
+	Bucket& bucketFor(uint64_t when)
+	{
+		// The first level whose span covers both ticks
+		const uint64_t differs = when ^ current;
+		size_t level = 0;
+		while (level < numLevels - 1 && (differs >> ((level + 1) * bitsPerLevel)) != 0)
+			++level;
+		return levels[level][bucketIndex(when, level)];
+	}
+
+	std::array<std::array<Bucket, bucketsPerLevel>, numLevels> levels;
+
+	uint64_t current; ///< The tick we're on
+
+	size_t count; ///< The number of items waiting
+
+	Bucket due; ///< Scratch space for the bucket we're emptying
+};
+
+template <typename T>
+const uint64_t TimerWheel<T>::horizon;
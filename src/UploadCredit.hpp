@@ -0,0 +1,36 @@
+#pragma once
+
+#include <atomic>
+
+/**
+ * \brief The number of chunks a peer can still upload this tick
+ *
+ * Any number of peers accepting offers from the same uploader can reserve credit at once.
+ * Reservations are a compare-and-swap on a single atomic counter,
+ * so popular uploaders (like the seeder) don't serialize every thread
+ * behind a mutex, and the credit can never drop below zero.
+ */
+class UploadCredit {
+public:
+
+	explicit UploadCredit(int initial = 0) : remaining(initial) { }
+
+	/// Sets the credit for a new tick. This must not race with reserve().
+	void reset(int credit) { remaining.store(credit, std::memory_order_relaxed); }
+
+	/// Takes one chunk of credit, returning false (and taking nothing) if there is none left
+	bool reserve()
+	{
+		int current = remaining.load(std::memory_order_relaxed);
+		// On failure, compare_exchange_weak reloads current for us
+		while (current > 0 &&
+		       !remaining.compare_exchange_weak(current, current - 1, std::memory_order_relaxed)) { }
+		return current > 0;
+	}
+
+	/// The credit left. Only meaningful when nobody is reserving.
+	int left() const { return remaining.load(std::memory_order_relaxed); }
+
+private:
+	std::atomic<int> remaining;
+};
@@ -1,4 +1,7 @@
+#include <chrono>
 #include <cstdio>
+#include <random>
+#include <string>
 #include <tclap/CmdLine.h>
 
 #include "Simulator.hpp"
@@ -45,11 +48,32 @@ int main(int argc, char** argv)
 	                             false, 0.2, "join probability");
 	ValueArg<double> leaveProbArg("l", "leave-prob", "The probability that a peer will leave in a given tick",
 	                              false, 0.01, "leave probability");
+	ValueArg<string> churnArg("C", "churn", "The distribution of how long peers stay connected and how long "
+	                          "they stay away: geometric, exponential, weibull, or pareto. Either way, the mean "
+	                          "is about one over the leave or join probability.", false, "geometric", "distribution");
+	ValueArg<double> shapeArg("k", "churn-shape", "The shape of the Weibull (default 0.5) or Pareto (default 2) "
+	                          "churn distribution", false, 0, "shape");
 	ValueArg<pair<int,int>> uploadArg("u", "upload-range", "The range (in chunks) of uplaod rates for each peer",
 	                                  false, pair<int, int>(10, 10), "min,max");
 	ValueArg<pair<int, int>> downloadArg("d", "download-range", "The range (in chunks) of download rates for each peer",
 	                                     false, pair<int, int>(100, 100), "min,max");
 	ValueArg<int> freeriderArg("f", "freeriders", "The number of free riders", false, 0, "number of free riders");
+	ValueArg<int> threadArg("t", "threads", "The number of threads to simulate with (default: one per hardware thread)",
+	                        false, 0, "number of threads");
+	ValueArg<int> grainArg("g", "grain", "The number of connected peers each worker claims at a time when working in parallel",
+	                       false, ThreadPool::defaultGrainSize, "number of peers");
+	ValueArg<unsigned long long> seedArg("s", "seed", "The seed for the random number generator "
+	                                     "(default: a random seed). With -D or -r, runs with the same seed "
+	                                     "and settings give the same output on any number of threads. "
+	                                     "Otherwise they only do on one thread (-t 1), since which offers "
+	                                     "get upload slots depends on thread timing.", false, 0, "seed");
+	SwitchArg deterministicArg("D", "deterministic", "Resolve offers in rounds so that the output "
+	                                                 "doesn't depend on the number of threads");
+	SwitchArg requestArg("r", "requests", "Have peers request chunks from the peers unchoking them, "
+	                                      "which grant what they can, instead of offering chunks");
+	SwitchArg summaryArg("S", "summary", "Print how many offers (or requests) were made and wasted, "
+	                                     "and how fast the run went, once it's done");
+	SwitchArg histogramArg("H", "histogram", "Print how many peers finished on each tick once the run is done");
 	SwitchArg machineArg("m", "machine-output", "Print machine output to be more easily parsed by, say, "
 	                                            " a stats generator.");
 
@@ -57,9 +81,18 @@ int main(int argc, char** argv)
 	cmd.add(chunkArg);
 	cmd.add(joinProbArg);
 	cmd.add(leaveProbArg);
+	cmd.add(churnArg);
+	cmd.add(shapeArg);
 	cmd.add(uploadArg);
 	cmd.add(downloadArg);
 	cmd.add(freeriderArg);
+	cmd.add(threadArg);
+	cmd.add(grainArg);
+	cmd.add(seedArg);
+	cmd.add(deterministicArg);
+	cmd.add(requestArg);
+	cmd.add(summaryArg);
+	cmd.add(histogramArg);
 	cmd.add(machineArg);
 	cmd.parse(argc, argv);
 
@@ -70,6 +103,15 @@ int main(int argc, char** argv)
 	const auto upload = uploadArg.getValue();
 	const auto download = downloadArg.getValue();
 	const auto frees = freeriderArg.getValue();
+	const auto threads = threadArg.getValue();
+	const auto grain = grainArg.getValue();
+
+	// Without a seed, make one up from the system's entropy
+	unsigned long long seed = seedArg.getValue();
+	if (!seedArg.isSet()) {
+		random_device entropy;
+		seed = ((unsigned long long)entropy() << 32) | entropy();
+	}
 
 	if (peers < 2)
 		howAboutNo("You cannot have fewer than two peers.");
@@ -88,6 +130,33 @@ int main(int argc, char** argv)
 		           "the torrent will likely never finish.\n");
 	}
 
+	ChurnModel::Distribution churnDist = ChurnModel::Distribution::geometric;
+	double shape = shapeArg.getValue();
+	const string churnName = churnArg.getValue();
+	if (churnName == "geometric") {
+		churnDist = ChurnModel::Distribution::geometric;
+	}
+	else if (churnName == "exponential") {
+		churnDist = ChurnModel::Distribution::exponential;
+	}
+	else if (churnName == "weibull") {
+		churnDist = ChurnModel::Distribution::weibull;
+		if (!shapeArg.isSet())
+			shape = 0.5;
+		if (shape <= 0.0)
+			howAboutNo("The Weibull shape must be positive.");
+	}
+	else if (churnName == "pareto") {
+		churnDist = ChurnModel::Distribution::pareto;
+		if (!shapeArg.isSet())
+			shape = 2.0;
+		if (shape <= 1.0)
+			howAboutNo("The Pareto shape must be greater than one, or peers would stay for forever on average.");
+	}
+	else {
+		howAboutNo("The churn distribution must be geometric, exponential, weibull, or pareto.");
+	}
+
 	if (upload.first > upload.second)
 		howAboutNo("Upload min cannot be greater than the upload max");
 
@@ -100,15 +169,48 @@ int main(int argc, char** argv)
 	if (peers - frees < 1)
 		howAboutNo("At least one peer cannot be a free rider");
 
+	if (threads < 0)
+		howAboutNo("You cannot have a negative number of threads.");
+
+	if (grain < 1)
+		howAboutNo("Threads must claim at least one peer at a time.");
+
+	if (deterministicArg.getValue() && requestArg.getValue())
+		howAboutNo("Requests are already resolved the same way on any number of threads; pick -D or -r.");
+
+	Simulator::Exchange exchange = Simulator::Exchange::offers;
+	if (deterministicArg.getValue())
+		exchange = Simulator::Exchange::reservations;
+	else if (requestArg.getValue())
+		exchange = Simulator::Exchange::requests;
+
 	printMachineOutput(machineArg.getValue());
+	printSeed(seed);
+
+	const ChurnModel churn(churnDist, joinProb, leaveProb, shape);
+
+	Simulator sim(peers, chunks, churn, upload, download, frees, seed, exchange, threads, grain);
 
-	Simulator sim(peers, chunks, joinProb, leaveProb, upload, download, frees);
+	if (seedArg.isSet() && exchange == Simulator::Exchange::offers && sim.threadCount() > 1) {
+		fprintf(stderr, "Warning: offers are resolved first-come, first-served on %zu threads, "
+		                "so this run won't repeat exactly. Use -D, -r, or -t 1 for that.\n", sim.threadCount());
+	}
 
+	const auto start = chrono::steady_clock::now();
 	while (!sim.allDone())
 		sim.tick();
+	const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+	if (histogramArg.getValue())
+		printHistogram(sim.completionHistogram());
+
+	if (summaryArg.getValue()) {
+		printSummary(exchange == Simulator::Exchange::requests ? "requests" : "offers",
+		             sim.offerCount(), sim.chunksSent(), sim.getTickCount(), elapsed.count());
+	}
 
 	if (!machineArg.getValue())
-		printf("Finished in %d ticks (seconds)\n", sim.getTickCount());
+		printf("Finished in %d ticks (seconds) with seed %llu\n", sim.getTickCount(), seed);
 
 	return 0;
 }
@@ -0,0 +1,141 @@
+#include "ChunkSetTests.hpp"
+
+#include <random>
+#include <vector>
+
+#include "Test.hpp"
+#include "ChunkSet.hpp"
+
+using namespace std;
+using namespace Testing;
+
+namespace {
+
+/// Test setting, clearing, and filling bits, including across word boundaries
+void basics()
+{
+	ChunkSet s(130);
+	assert(s.size() == 130);
+	assert(s.none());
+	assert(s.count() == 0);
+
+	s.set(0);
+	s.set(64);
+	s.set(129);
+	assert(s[0] && s[64] && s[129]);
+	assert(!s[1] && !s[63] && !s[128]);
+	assert(s.count() == 3);
+
+	s.reset(64);
+	assert(!s[64]);
+	assert(s.count() == 2);
+
+	s.fill(true);
+	assert(s.all());
+	// The bits past the end shouldn't be counted
+	assert(s.count() == 130);
+
+	s.fill(false);
+	assert(s.none());
+
+	ChunkSet full(70, true);
+	assert(full.all());
+	assert(full.count() == 70);
+
+	ChunkSet fromList = { true, false, true };
+	assert(fromList.size() == 3);
+	assert(fromList[0] && !fromList[1] && fromList[2]);
+}
+
+/// Test "do I have anything you don't?" on sets large enough to hit the vector paths
+void andNotAny()
+{
+	// Pick a size that isn't a multiple of any vector width
+	const size_t n = 64 * 9 + 5;
+	ChunkSet mine(n);
+	ChunkSet theirs(n);
+
+	assert(!mine.andNotAny(theirs));
+
+	// Check every position so that we cover the vector body and the scalar tail
+	for (size_t i = 0; i < n; ++i) {
+		mine.set(i);
+		assert(mine.andNotAny(theirs));
+		theirs.set(i);
+		assert(!mine.andNotAny(theirs));
+		mine.reset(i);
+		theirs.reset(i);
+	}
+
+	// They have everything, so we can't help them
+	theirs.fill(true);
+	mine.set(3);
+	mine.set(n - 1);
+	assert(!mine.andNotAny(theirs));
+	assert(theirs.andNotAny(mine));
+
+	assert(mine.andNotCount(theirs) == 0);
+	assert(theirs.andNotCount(mine) == n - 2);
+}
+
+/// Check every kernel this machine supports against andNotCount(), which doesn't vectorize,
+/// on sizes that leave every possible tail for the two- and four-word loops
+void kernels()
+{
+	typedef ChunkSet::Kernel Kernel;
+	const Kernel all[] = { Kernel::scalar, Kernel::sse2, Kernel::avx2 };
+
+	mt19937 rng(42);
+	for (size_t n = 1; n <= 64 * 9; n += 7) {
+		ChunkSet mine(n);
+		ChunkSet theirs(n);
+
+		for (int trial = 0; trial < 20; ++trial) {
+			// Have them mostly overlap so that we see both answers
+			for (size_t i = 0; i < n; ++i) {
+				const bool has = rng() % 2 == 0;
+				if (has)
+					theirs.set(i);
+				else
+					theirs.reset(i);
+
+				if (has ? rng() % 8 != 0 : rng() % (4 * n) == 0)
+					mine.set(i);
+				else
+					mine.reset(i);
+			}
+
+			const bool expected = mine.andNotCount(theirs) != 0;
+			assert(mine.andNotAny(theirs) == expected);
+			for (Kernel k : all) {
+				if (k > ChunkSet::fastestKernel())
+					break;
+				assert(mine.andNotAny(theirs, k) == expected);
+			}
+		}
+	}
+}
+
+/// Test iterating over set bits
+void iteration()
+{
+	ChunkSet s(200);
+	const vector<size_t> expected = { 0, 5, 63, 64, 127, 150, 199 };
+	for (size_t i : expected)
+		s.set(i);
+
+	vector<size_t> got;
+	s.forEachSet([&](size_t i) { got.emplace_back(i); });
+	assert(got == expected);
+}
+
+} // end anonymous namespace
+
+void Testing::runChunkSetTests()
+{
+	beginUnit("ChunkSet");
+	test("Basics", &basics);
+	test("And-not-any", &andNotAny);
+	test("And-not-any kernels", &kernels);
+	test("Iteration", &iteration);
+}
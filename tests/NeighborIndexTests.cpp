@@ -0,0 +1,82 @@
+#include "NeighborIndexTests.hpp"
+
+#include <map>
+#include <random>
+
+#include "Test.hpp"
+#include "NeighborIndex.hpp"
+
+using namespace std;
+using namespace Testing;
+
+namespace {
+
+/// Test that lookups find what was put in, even as neighbors come and go
+void lookups()
+{
+	NeighborIndex index;
+	assert(index.find(7) == NeighborIndex::none);
+
+	index.reset(4);
+	index.insert(7, 0);
+	index.insert(3, 1);
+	assert(index.find(7) == 0);
+	assert(index.find(3) == 1);
+	assert(index.find(4) == NeighborIndex::none);
+
+	index.move(7, 5);
+	assert(index.find(7) == 5);
+
+	index.erase(7);
+	assert(index.find(7) == NeighborIndex::none);
+	assert(index.find(3) == 1);
+	assert(index.size() == 1);
+
+	index.clear();
+	assert(index.size() == 0);
+	assert(index.find(3) == NeighborIndex::none);
+}
+
+/// Hammer the index with random changes, growing it past its starting size,
+/// and check it against a map after every one
+void churn()
+{
+	NeighborIndex index;
+	index.reset(8);
+	map<uint32_t, uint32_t> expected;
+
+	mt19937 gen(537);
+	// Draw from a small range of slots so that we collide and erase a lot
+	uniform_int_distribution<uint32_t> slots(0, 99);
+	for (uint32_t i = 0; i < 20000; ++i) {
+		const uint32_t slot = slots(gen);
+		auto it = expected.find(slot);
+		if (it == expected.end()) {
+			index.insert(slot, i);
+			expected[slot] = i;
+		}
+		else if (i % 3 == 0) {
+			index.move(slot, i);
+			it->second = i;
+		}
+		else {
+			index.erase(slot);
+			expected.erase(it);
+		}
+
+		assert(index.size() == expected.size());
+		for (uint32_t s = 0; s < 100; ++s) {
+			auto e = expected.find(s);
+			assert(index.find(s) == (e == expected.end() ? NeighborIndex::none : e->second));
+		}
+	}
+}
+
+} // end anonymous namespace
+
+void Testing::runNeighborIndexTests()
+{
+	beginUnit("NeighborIndex");
+	test("Lookups", &lookups);
+	test("Churn", &churn);
+}
@@ -0,0 +1,55 @@
+#include "OfferStoreTests.hpp"
+
+#include "Test.hpp"
+#include "OfferStore.hpp"
+
+using namespace std;
+using namespace Testing;
+
+namespace {
+
+/// Test that offers from several workers end up grouped by recipient, in order
+void scatter()
+{
+	// Handles are never resolved here, so they don't need a PeerStore behind them
+	PeerHandle peers[3];
+	for (uint32_t i = 0; i < 3; ++i)
+		peers[i] = PeerHandle(i, 0);
+
+	OfferStore store(2);
+
+	// Run it twice to make sure clear() resets everything
+	for (int run = 0; run < 2; ++run) {
+		store.clear();
+
+		store.buffer(0).emplace_back(peers[2], peers[0], 5);
+		store.buffer(0).emplace_back(peers[0], peers[1], 1);
+		store.buffer(1).emplace_back(peers[2], peers[1], 7);
+		store.buffer(0).emplace_back(peers[2], peers[0], 6);
+
+		store.scatter(3);
+
+		assert(store.offersEnd(0) - store.offersBegin(0) == 1);
+		assert(store.offersBegin(0)->from == peers[1]);
+		assert(store.offersBegin(0)->chunkIdx == 1);
+
+		// Nobody offered anything to peer 1
+		assert(store.offersBegin(1) == store.offersEnd(1));
+
+		// Peer 2's offers should be in the order they were made, worker by worker
+		const Offer* o = store.offersBegin(2);
+		assert(store.offersEnd(2) - o == 3);
+		assert(o[0].chunkIdx == 5);
+		assert(o[1].chunkIdx == 6);
+		assert(o[2].chunkIdx == 7);
+		assert(o[2].from == peers[1]);
+	}
+}
+
+} // end anonymous namespace
+
+void Testing::runOfferStoreTests()
+{
+	beginUnit("OfferStore");
+	test("Scatter", &scatter);
+}
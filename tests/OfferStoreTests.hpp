@@ -0,0 +1,7 @@
+#pragma once
+
+namespace Testing {
+
+void runOfferStoreTests();
+
+} // end namespace Testing
@@ -0,0 +1,193 @@
+#include "PeerStoreTests.hpp"
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "Test.hpp"
+#include "PeerStore.hpp"
+
+using namespace std;
+using namespace Testing;
+
+namespace {
+
+/// Gets the IPs of the connected peers, sorted, since the store doesn't keep them in any order
+vector<int> connectedIPs(PeerStore& store)
+{
+	vector<int> ret;
+	for (size_t i = 0; i < store.connectedCount(); ++i)
+		ret.emplace_back(store.connectedPeer(i).IPAddress);
+	sort(begin(ret), end(ret));
+	return ret;
+}
+
+/// Gets the IPs of the disconnected peers, sorted
+vector<int> disconnectedIPs(PeerStore& store)
+{
+	vector<int> ret;
+	for (size_t i = 0; i < store.disconnectedCount(); ++i)
+		ret.emplace_back(store.disconnectedPeer(i).IPAddress);
+	sort(begin(ret), end(ret));
+	return ret;
+}
+
+/// Test that peers move between the connected and disconnected lists without moving in memory
+void connecting()
+{
+	// Use a small block size so that the store has to grow
+	PeerStore store(2);
+
+	vector<Peer*> added;
+	added.emplace_back(&store.add(true, 0, 1, 1, 10, true));
+	for (int i = 1; i < 5; ++i)
+		added.emplace_back(&store.add(false, i, 1, 1, 10, false));
+
+	assert(store.size() == 5);
+	assert(store.capacity() >= 5);
+	assert(connectedIPs(store) == vector<int>({0}));
+	assert(disconnectedIPs(store) == vector<int>({1, 2, 3, 4}));
+
+	store.connect(*added[2]);
+	store.connect(*added[4]);
+	store.connect(*added[1]);
+	assert(connectedIPs(store) == vector<int>({0, 1, 2, 4}));
+	assert(disconnectedIPs(store) == vector<int>({3}));
+	assert(store.isConnected(*added[2]));
+	assert(!store.isConnected(*added[3]));
+
+	store.disconnect(*added[2]);
+	store.disconnect(*added[0]);
+	assert(connectedIPs(store) == vector<int>({1, 4}));
+	assert(disconnectedIPs(store) == vector<int>({0, 2, 3}));
+
+	// Everyone should still be where we left them
+	for (size_t i = 0; i < added.size(); ++i) {
+		assert(added[i]->IPAddress == (int)i);
+		assert(&store.at(store.slotOf(*added[i])) == added[i]);
+	}
+
+	// Iterating over the store should visit everyone
+	vector<int> all;
+	for (const Peer& p : store)
+		all.emplace_back(p.IPAddress);
+	assert(all == vector<int>({0, 1, 2, 3, 4}));
+}
+
+/// Test that handles stop resolving once their peer disconnects
+void handles()
+{
+	PeerStore store(4);
+	Peer& p = store.add(true, 0, 1, 1, 10, false);
+
+	const PeerHandle before = store.handleOf(p);
+	assert(store.isCurrent(before));
+	assert(store.resolve(before) == &p);
+
+	store.disconnect(p);
+	assert(!store.isCurrent(before));
+	assert(store.resolve(before) == nullptr);
+
+	// Reconnecting doesn't bring old handles back
+	store.connect(p);
+	const PeerHandle after = store.handleOf(p);
+	assert(after.index == before.index);
+	assert(after != before);
+	assert(store.resolve(before) == nullptr);
+	assert(store.resolve(after) == &p);
+	assert(store.connectedHandle(0) == after);
+}
+
+/// Test drawing random incomplete peers
+void sampling()
+{
+	PeerStore store(16);
+	vector<Peer*> added;
+	// Even peers are seeds, and every third peer stays disconnected
+	for (int i = 0; i < 90; ++i) {
+		added.emplace_back(&store.add(i % 3 != 0, i, 1, 1, 10, i % 2 == 0));
+		if (i % 2 == 0 && i % 3 != 0)
+			store.markComplete(*added.back()); // Shouldn't matter for peers that never needed anything
+	}
+
+	auto eligible = [&](const Peer& p) { return store.isConnected(p) && !p.hasEverything(); };
+	assert(store.incompleteCount() == (size_t)count_if(begin(added), end(added),
+	                                                   [&](Peer* p) { return eligible(*p); }));
+
+	mt19937 rng(42);
+	const vector<PeerHandle> ignore = { store.handleOf(*added[1]), store.handleOf(*added[5]) };
+
+	auto check = [&](size_t num, size_t expected) {
+		vector<PeerHandle> picked;
+		store.sampleIncomplete(num, ignore, rng, picked);
+		assert(picked.size() == expected);
+		for (size_t i = 0; i < picked.size(); ++i) {
+			assert(store.isCurrent(picked[i]));
+			assert(eligible(store.at(picked[i].index)));
+			for (PeerHandle h : ignore)
+				assert(h.index != picked[i].index);
+			for (size_t j = 0; j < i; ++j)
+				assert(picked[i] != picked[j]);
+		}
+	};
+
+	// 30 peers are connected and incomplete, two of which we ignore
+	assert(store.incompleteCount() == 30);
+	check(5, 5); // Rejection sampling
+	check(20, 20); // Walking the list
+	check(40, 28); // Not enough to go around
+
+	// Disconnecting takes peers out of the running
+	for (Peer* p : added) {
+		if (eligible(*p))
+			store.disconnect(*p);
+	}
+	assert(store.incompleteCount() == 0);
+	check(5, 0);
+}
+
+/// Test keeping count of who has everything
+void completion()
+{
+	PeerStore store(4);
+	Peer& seed = store.add(true, 0, 1, 1, 2, true);
+	Peer& p1 = store.add(true, 1, 1, 1, 2, false);
+	Peer& p2 = store.add(false, 2, 1, 1, 2, false);
+	assert(store.completeCount() == 1);
+	assert(!store.allComplete());
+
+	p1.onConnect();
+	p1.receiveChunk(0);
+	assert(p1.chunkCount() == 1);
+	assert(!p1.hasEverything());
+	p1.receiveChunk(1);
+	assert(p1.hasEverything());
+	store.markComplete(p1);
+	assert(store.completeCount() == 2);
+
+	// Marking a peer twice (or a seed at all) doesn't count it again
+	store.markComplete(p1);
+	store.markComplete(seed);
+	assert(store.completeCount() == 2);
+
+	// Once the last peer connects and finishes, everyone's done
+	p2.onConnect();
+	store.connect(p2);
+	assert(store.incompleteCount() == 1);
+	p2.receiveChunk(0);
+	p2.receiveChunk(1);
+	store.markComplete(p2);
+	assert(store.incompleteCount() == 0);
+	assert(store.allComplete());
+}
+
+} // end namespace anonymous
+
+void Testing::runPeerStoreTests()
+{
+	beginUnit("PeerStore");
+	test("Connecting", &connecting);
+	test("Handles", &handles);
+	test("Sampling", &sampling);
+	test("Completion", &completion);
+}
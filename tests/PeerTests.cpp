@@ -1,124 +1,630 @@
 #include "PeerTests.hpp"
 
+#include <algorithm>
+
 #include "Test.hpp"
 #include "Peer.hpp"
+#include "PeerStore.hpp"
+
+using namespace std;
 
 namespace {
 
+/// Connects a peer and gives it the chunks marked true in _chunks_
+void setUp(Peer& p, std::initializer_list<bool> chunks)
+{
+	p.onConnect();
+	size_t i = 0;
+	for (bool has : chunks) {
+		if (has)
+			p.receiveChunk(i);
+		++i;
+	}
+}
+
+/// Has a peer make its offers, then groups them by recipient (in the order they were first offered to)
+vector<pair<PeerHandle, vector<size_t>>> makeOffers(PeerStore& store, Peer& p)
+{
+	OfferStore::Buffer buffer;
+	p.makeOffers(store.handleOf(p), store, buffer);
+
+	vector<pair<PeerHandle, vector<size_t>>> ret;
+	for (const auto& r : buffer) {
+		assert(r.offer.from == store.handleOf(p));
+		auto it = find_if(begin(ret), end(ret), [&](const pair<PeerHandle, vector<size_t>>& o) { return o.first == r.to; });
+		if (it == end(ret)) {
+			ret.emplace_back(r.to, vector<size_t>());
+			it = end(ret) - 1;
+		}
+		it->second.emplace_back(r.offer.chunkIdx);
+	}
+	return ret;
+}
+
+/// Disconnects a group of peers at once, the way the simulator does
+/// \returns the changes the leavers made to their neighbors' listedBy, which have already been applied
+vector<Peer::ListingChange> leave(PeerStore& store, std::initializer_list<Peer*> leavers)
+{
+	vector<uint8_t> leaving(store.size(), 0);
+	for (Peer* p : leavers)
+		leaving[store.slotOf(*p)] = 1;
+
+	// Everyone who lists a leaver drops them, unless they're leaving too
+	vector<uint32_t> listers;
+	for (Peer* p : leavers) {
+		for (uint32_t lister : p->listedBy) {
+			if (!leaving[lister] && find(begin(listers), end(listers), lister) == end(listers))
+				listers.emplace_back(lister);
+		}
+	}
+	for (uint32_t lister : listers)
+		store.at(lister).dropNeighbors(leaving, store);
+
+	vector<Peer::ListingChange> changes;
+	for (Peer* p : leavers)
+		p->onDisconnect(leaving, store, changes);
+	for (const auto& c : changes)
+		store.at(c.peer).updateListedBy(c);
+
+	for (Peer* p : leavers)
+		store.disconnect(*p);
+	return changes;
+}
+
 void everythingTest()
 {
-	Peer p(1, 2, 3);
-	p.chunkList = { true, false, true };
+	Peer seed(0, 2, 3, 3, true);
+	assert(seed.hasEverything());
+	assert(seed.chunkList.all());
+
+	Peer p(1, 2, 3, 3, false);
 	assert(!p.hasEverything());
-	p.chunkList[1] = true;
-	assert(p.hasEverything());
+	assert(p.chunkList.none());
 }
 
 void simpleOffers()
 {
 	// Offer one chunk
 	{
-		Peer p1(1, 1, 1);
-		Peer p2(2, 1, 1);
+		PeerStore store(4);
+		Peer& p1 = store.add(true, 1, 1, 1, 1, false);
+		Peer& p2 = store.add(true, 2, 1, 1, 1, false);
 
-		p1.chunkList = { true };
-		p2.chunkList = { false };
+		setUp(p1, { true });
+		setUp(p2, { false });
 
-		p1.interestedList = { {&p2, 0} };
+		p1.addNeighbor(store.handleOf(p2), store);
 
-		auto offers = p1.makeOffers();
+		auto offers = makeOffers(store, p1);
 		assert(offers.size() == 1);
-		assert(offers[0].first == &p2); // Offering to p2
+		assert(offers[0].first == store.handleOf(p2)); // Offering to p2
 		assert(offers[0].second.size() == 1); // Should only offer one chunk
 		assert(offers[0].second[0] == 0); // Should be offering chunk 0
 	}
 	// Offer no chunks because we don't have any
 	{
-		Peer p1(1, 1, 1);
-		Peer p2(2, 1, 1);
+		PeerStore store(4);
+		Peer& p1 = store.add(true, 1, 1, 1, 1, false);
+		Peer& p2 = store.add(true, 2, 1, 1, 1, false);
 
-		p1.chunkList = { false };
-		p2.chunkList = { false };
+		setUp(p1, { false });
+		setUp(p2, { false });
 
-		p1.interestedList = { {&p2, 0} };
+		p1.addNeighbor(store.handleOf(p2), store);
 
-		auto offers = p1.makeOffers();
+		auto offers = makeOffers(store, p1);
 		// We don't care if we make an offer or not, but if we do,
 		// it had better be a zero-sized offer
 		if (!offers.empty()) {
-			assert(offers[0].first == &p2); // Offering to p2
+			assert(offers[0].first == store.handleOf(p2)); // Offering to p2
 			assert(offers[0].second.size() == 0); // Should offer nothing
 		}
 	}
 	// Offer no chunks because everyone has them
 	{
-		Peer p1(1, 1, 1);
-		Peer p2(2, 1, 1);
+		PeerStore store(4);
+		Peer& p1 = store.add(true, 1, 1, 1, 1, false);
+		Peer& p2 = store.add(true, 2, 1, 1, 1, false);
 
-		p1.chunkList = { true };
-		p2.chunkList = { true };
+		setUp(p1, { true });
+		setUp(p2, { true });
 
-		p1.interestedList = { {&p2, 0} };
+		p1.addNeighbor(store.handleOf(p2), store);
 
-		auto offers = p1.makeOffers();
+		auto offers = makeOffers(store, p1);
 		// We don't care if we make an offer or not, but if we do,
 		// it had better be a zero-sized offer
 		if (!offers.empty()) {
-			assert(offers[0].first == &p2); // Offering to p2
+			assert(offers[0].first == store.handleOf(p2)); // Offering to p2
 			assert(offers[0].second.size() == 0); // Should offer nothing
 		}
 	}
 	// Make sure we're offering the right chunk
 	{
-		Peer p1(1, 1, 1);
-		Peer p2(2, 1, 1);
+		PeerStore store(4);
+		Peer& p1 = store.add(true, 1, 1, 1, 3, false);
+		Peer& p2 = store.add(true, 2, 1, 1, 3, false);
 
-		p1.chunkList = { false, false, true };
-		p2.chunkList = { false, false, false };
+		setUp(p1, { false, false, true });
+		setUp(p2, { false, false, false });
 
-		p1.interestedList = { {&p2, 0} };
+		p1.addNeighbor(store.handleOf(p2), store);
 
-		auto offers = p1.makeOffers();
+		auto offers = makeOffers(store, p1);
 		assert(offers.size() == 1);
-		assert(offers[0].first == &p2); // Offering to p2
+		assert(offers[0].first == store.handleOf(p2)); // Offering to p2
 		assert(offers[0].second.size() == 1); // Should only offer one chunk
 		assert(offers[0].second[0] == 2); // Should be offering chunk 2
 	}
 	// Make sure we're offering multiple chunks
 	{
-		Peer p1(1, 2, 1);
-		Peer p2(2, 1, 1);
+		PeerStore store(4);
+		Peer& p1 = store.add(true, 1, 2, 1, 3, false);
+		Peer& p2 = store.add(true, 2, 1, 1, 3, false);
 
-		p1.chunkList = { true, false, true };
-		p2.chunkList = { false, false, false };
+		setUp(p1, { true, false, true });
+		setUp(p2, { false, false, false });
 
-		p1.interestedList = { {&p2, 0} };
+		p1.addNeighbor(store.handleOf(p2), store);
 
-		auto offers = p1.makeOffers();
+		auto offers = makeOffers(store, p1);
 		assert(offers.size() == 1);
-		assert(offers[0].first == &p2);
+		assert(offers[0].first == store.handleOf(p2));
 		assert(offers[0].second.size() == 2);
 		assert(offers[0].second[0] == 0);
 		assert(offers[0].second[1] == 2);
 	}
 	// Make sure we're not offering multiple if we don't have the bandwidth
 	{
-		Peer p1(1, 1, 1);
-		Peer p2(2, 1, 1);
+		PeerStore store(4);
+		Peer& p1 = store.add(true, 1, 1, 1, 3, false);
+		Peer& p2 = store.add(true, 2, 1, 1, 3, false);
 
-		p1.chunkList = { true, false, true };
-		p2.chunkList = { false, false, false };
+		setUp(p1, { true, false, true });
+		setUp(p2, { false, false, false });
 
-		p1.interestedList = { {&p2, 0} };
+		p1.addNeighbor(store.handleOf(p2), store);
 
-		auto offers = p1.makeOffers();
+		auto offers = makeOffers(store, p1);
 		assert(offers.size() == 1);
-		assert(offers[0].first == &p2);
+		assert(offers[0].first == store.handleOf(p2));
 		assert(offers[0].second.size() == 1);
 		assert(offers[0].second[0] == 0);
 	}
 }
 
+/// Make sure we offer the rarest chunks first, and that each neighbor gets what it lacks
+void rarestFirst()
+{
+	PeerStore store(4);
+	Peer& p1 = store.add(true, 1, 2, 1, 3, false);
+	Peer& p2 = store.add(true, 2, 1, 1, 3, false);
+	Peer& p3 = store.add(true, 3, 1, 1, 3, false);
+
+	setUp(p1, { true, true, true });
+	setUp(p2, { true, true, false });
+	setUp(p3, { true, false, false });
+
+	// Chunk 0 is the most popular (2), then 1 (1), then 2 (0)
+	p1.addNeighbor(store.handleOf(p2), store);
+	p1.addNeighbor(store.handleOf(p3), store);
+
+	auto offers = makeOffers(store, p1);
+	assert(offers.size() == 2);
+	assert(offers[0].first == store.handleOf(p2));
+	assert(offers[0].second == vector<size_t>({ 2 }));
+	assert(offers[1].first == store.handleOf(p3));
+	assert(offers[1].second == vector<size_t>({ 2, 1 }));
+
+	// Once p3 gets chunk 2, it should only be offered chunk 1
+	p3.acceptOffers(store);
+	p3.receiveChunk(2);
+	p1.syncPopularity(store);
+
+	offers = makeOffers(store, p1);
+	assert(offers.size() == 2);
+	assert(offers[0].second == vector<size_t>({ 2 }));
+	assert(offers[1].second == vector<size_t>({ 1 }));
+}
+
+/// Make sure popularity counts follow our neighbors as they come, go, and get chunks
+void popularity()
+{
+	PeerStore store(4);
+	Peer& p1 = store.add(true, 1, 1, 1, 3, false);
+	Peer& p2 = store.add(true, 2, 1, 1, 3, false);
+	Peer& p3 = store.add(true, 3, 1, 1, 3, false);
+
+	setUp(p1, { false, false, false });
+	setUp(p2, { true, false, false });
+	setUp(p3, { true, true, false });
+
+	p1.addNeighbor(store.handleOf(p2), store);
+	p1.addNeighbor(store.handleOf(p3), store);
+	assert(p1.getPopularity(0) == 2);
+	assert(p1.getPopularity(1) == 1);
+	assert(p1.getPopularity(2) == 0);
+
+	// p2 gets a chunk the next tick, and p1 should count it once it syncs up
+	// (Nothing to accept, but this starts each peer's new tick.)
+	p2.acceptOffers(store);
+	p3.acceptOffers(store);
+	p2.receiveChunk(2);
+	assert(p1.getPopularity(2) == 0);
+	p1.syncPopularity(store);
+	assert(p1.getPopularity(2) == 1);
+
+	// Drop p3, and its chunks shouldn't count anymore
+	p1.removeNeighbor(p1.interestedList.begin() + 1, store);
+	assert(p1.getPopularity(0) == 1);
+	assert(p1.getPopularity(1) == 0);
+	assert(p1.getPopularity(2) == 1);
+}
+
+/// Checks that a peer's popularity counts match a recount of its neighbors' chunks
+void assertPopularityExact(const PeerStore& store, const Peer& p)
+{
+	for (size_t i = 0; i < p.chunkList.size(); ++i) {
+		int count = 0;
+		for (const auto& n : p.interestedList)
+			count += store.at(n.index).chunkList[i] ? 1 : 0;
+		assert(p.getPopularity(i) == count);
+	}
+}
+
+/// Make sure popularity counts stay exact as a neighbor leaves and comes back with different chunks
+void churnedPopularity()
+{
+	PeerStore store(4);
+	Peer& p1 = store.add(true, 1, 1, 1, 3, false);
+	Peer& p2 = store.add(true, 2, 1, 1, 3, false);
+	Peer& p3 = store.add(true, 3, 1, 1, 3, false);
+
+	setUp(p1, { false, false, false });
+	setUp(p2, { true, false, false });
+	setUp(p3, { true, true, false });
+
+	p1.addNeighbor(store.handleOf(p2), store);
+	p1.addNeighbor(store.handleOf(p3), store);
+	assertPopularityExact(store, p1);
+
+	// p2 leaves...
+	assert(leave(store, { &p2 }).empty());
+	assertPopularityExact(store, p1);
+
+	// ...and comes back with another chunk, so its old handle (and its old chunks) mean nothing now
+	setUp(p2, { false, false, true });
+	store.connect(p2);
+	p1.addNeighbor(store.handleOf(p2), store);
+	assert(p1.getPopularity(2) == 1);
+	assertPopularityExact(store, p1);
+
+	// Taking everyone back out should leave nothing counted
+	while (!p1.interestedList.empty())
+		p1.removeNeighbor(p1.interestedList.begin(), store);
+	for (size_t i = 0; i < p1.chunkList.size(); ++i)
+		assert(p1.getPopularity(i) == 0);
+}
+
+/// Make sure we don't make offers to neighbors who have left
+void departedNeighbors()
+{
+	PeerStore store(4);
+	Peer& p1 = store.add(true, 1, 2, 1, 2, false);
+	Peer& p2 = store.add(true, 2, 1, 1, 2, false);
+	Peer& p3 = store.add(true, 3, 1, 1, 2, false);
+
+	setUp(p1, { true, true });
+	setUp(p2, { false, false });
+	setUp(p3, { false, false });
+
+	p1.addNeighbor(store.handleOf(p2), store);
+	p1.addNeighbor(store.handleOf(p3), store);
+	assert(makeOffers(store, p1).size() == 2);
+
+	leave(store, { &p2 });
+	assert(p1.interestedList.size() == 1);
+	auto offers = makeOffers(store, p1);
+	assert(offers.size() == 1);
+	assert(offers[0].first == store.handleOf(p3));
+}
+
+/// Make sure a peer that leaves is taken out of everyone's lists, and everyone out of its
+void leaving()
+{
+	PeerStore store(4);
+	Peer& p1 = store.add(true, 1, 1, 1, 2, false);
+	Peer& p2 = store.add(true, 2, 1, 1, 2, false);
+	Peer& p3 = store.add(true, 3, 1, 1, 2, false);
+
+	setUp(p1, { false, false });
+	setUp(p2, { true, false });
+	setUp(p3, { true, true });
+
+	p1.addNeighbor(store.handleOf(p2), store);
+	p1.addNeighbor(store.handleOf(p3), store);
+	p3.addNeighbor(store.handleOf(p2), store);
+	p2.addNeighbor(store.handleOf(p3), store);
+	assert(p2.listedBy.size() == 2);
+	assert(p3.listedBy.size() == 2);
+	assert(p1.getPopularity(0) == 2);
+
+	leave(store, { &p2 });
+
+	assert(p2.listedBy.empty());
+	assert(p2.interestedList.empty());
+
+	assert(p1.interestedList.size() == 1);
+	assert(p1.interestedList[0].handle() == store.handleOf(p3));
+	assert(p1.getPopularity(0) == 1);
+	assert(p1.getPopularity(1) == 1);
+	assert(p3.interestedList.empty());
+
+	// p3 is now only listed by p1
+	assert(p3.listedBy == vector<uint32_t>({ (uint32_t)store.slotOf(p1) }));
+}
+
+/// Make sure peers leaving together drop each other without telling each other
+void leavingTogether()
+{
+	PeerStore store(4);
+	Peer& p1 = store.add(true, 1, 1, 1, 2, false);
+	Peer& p2 = store.add(true, 2, 1, 1, 2, false);
+	Peer& p3 = store.add(true, 3, 1, 1, 2, false);
+	Peer& p4 = store.add(true, 4, 1, 1, 2, false);
+
+	setUp(p1, { false, false });
+	setUp(p2, { true, false });
+	setUp(p3, { true, true });
+	setUp(p4, { false, true });
+
+	p1.addNeighbor(store.handleOf(p2), store);
+	p1.addNeighbor(store.handleOf(p3), store);
+	p1.addNeighbor(store.handleOf(p4), store);
+	p3.addNeighbor(store.handleOf(p2), store);
+	p2.addNeighbor(store.handleOf(p3), store);
+	p2.addNeighbor(store.handleOf(p4), store);
+	assert(p1.getPopularity(0) == 2);
+	assert(p1.getPopularity(1) == 2);
+
+	// p2 and p3 leave together
+	const auto changes = leave(store, { &p2, &p3 });
+
+	for (Peer* p : { &p2, &p3 }) {
+		assert(p->listedBy.empty());
+		assert(p->interestedList.empty());
+	}
+
+	// p1 keeps p4, and only counts its chunks
+	assert(p1.interestedList.size() == 1);
+	assert(p1.interestedList[0].handle() == store.handleOf(p4));
+	assert(p1.getPopularity(0) == 0);
+	assert(p1.getPopularity(1) == 1);
+
+	// p2 told p4 it left, but didn't bother telling p3
+	assert(changes.size() == 1);
+	assert(p4.listedBy == vector<uint32_t>({ (uint32_t)store.slotOf(p1) }));
+}
+
+/// Make sure the deferred addNeighbor and removeNeighbor overloads only touch the peer calling them
+void deferredListing()
+{
+	PeerStore store(4);
+	Peer& p1 = store.add(true, 1, 1, 1, 2, false);
+	Peer& p2 = store.add(true, 2, 1, 1, 2, false);
+
+	setUp(p1, { false, false });
+	setUp(p2, { true, false });
+
+	// Popularity changes right away, but p2 doesn't hear about it until we apply the changes.
+	vector<Peer::ListingChange> changes;
+	p1.addNeighbor(store.handleOf(p2), store, changes);
+	assert(p1.getPopularity(0) == 1);
+	assert(p2.listedBy.empty());
+	assert(changes.size() == 1);
+	assert(changes[0].peer == store.slotOf(p2));
+	assert(changes[0].listed);
+
+	p1.removeNeighbor(begin(p1.interestedList), store, changes);
+	assert(p1.getPopularity(0) == 0);
+	assert(p1.interestedList.empty());
+	assert(changes.size() == 2);
+	assert(!changes[1].listed);
+
+	// Applied in order, the add and the drop cancel out.
+	p2.updateListedBy(changes[0]);
+	assert(p2.listedBy == vector<uint32_t>({ (uint32_t)store.slotOf(p1) }));
+	p2.updateListedBy(changes[1]);
+	assert(p2.listedBy.empty());
+}
+
+/// Test that contested upload slots go to the same peers every time, and that losers try elsewhere
+void reservations()
+{
+	PeerStore store(8);
+	Peer& first = store.add(true, 0, 1, 1, 2, false);
+	Peer& u1 = store.add(true, 1, 1, 1, 2, false);
+	Peer& u2 = store.add(true, 2, 1, 1, 2, false);
+	Peer& second = store.add(true, 3, 1, 1, 2, false);
+
+	setUp(first, { false, false });
+	setUp(u1, { true, false });
+	setUp(u2, { true, false });
+	setUp(second, { false, false });
+
+	// Both uploaders have one upload slot. u1 offers chunk 0 to both downloaders, u2 just to the second.
+	u1.addNeighbor(store.handleOf(first), store);
+	u1.addNeighbor(store.handleOf(second), store);
+	u2.addNeighbor(store.handleOf(second), store);
+
+	OfferStore offers(1);
+	u1.makeOffers(store.handleOf(u1), store, offers.buffer(0));
+	u2.makeOffers(store.handleOf(u2), store, offers.buffer(0));
+	offers.scatter(store.capacity());
+
+	Peer* downloaders[] = { &first, &second };
+	for (Peer* d : downloaders) {
+		const size_t slot = store.slotOf(*d);
+		d->considerOffers(offers.offersBegin(slot), offers.offersEnd(slot));
+		d->beginReservations();
+	}
+
+	// Both reserve chunk 0 from u1 (the sender in the lower slot), and the second saves u2's offer for later.
+	assert(first.reserveOffers());
+	assert(second.reserveOffers());
+	assert(second.reservationsThisTick().size() == 1);
+	assert(second.reservationsThisTick()[0].from == store.slotOf(u1));
+
+	// Their chunk is just as rare to u1 either way, so the peer in the lower slot gets it.
+	u1.confirmReservations(store);
+	u2.confirmReservations(store);
+	assert(first.reservationsThisTick()[0].confirmed);
+	assert(!second.reservationsThisTick()[0].confirmed);
+
+	// The second peer tries u2 instead.
+	assert(!first.reserveOffers());
+	assert(first.chunkList[0]);
+	assert(second.reserveOffers());
+	assert(second.reservationsThisTick()[1].from == store.slotOf(u2));
+
+	u1.confirmReservations(store);
+	u2.confirmReservations(store);
+	assert(!first.reserveOffers());
+	assert(!second.reserveOffers());
+
+	for (Peer* d : downloaders) {
+		d->finishReservations();
+		assert(d->chunkList[0]);
+		assert(!d->hasEverything());
+	}
+}
+
+/// Make sure we accept the rarest chunks first, breaking ties by chunk
+void rankingOffers()
+{
+	PeerStore store(4);
+	Peer& d = store.add(true, 0, 1, 2, 4, false);
+	Peer& a = store.add(true, 1, 4, 1, 4, false);
+	Peer& b = store.add(true, 2, 4, 1, 4, false);
+	Peer& c = store.add(true, 3, 4, 1, 4, false);
+
+	setUp(d, { false, false, false, false });
+	setUp(a, { true, true, false, false });
+	setUp(b, { true, false, true, false });
+	setUp(c, { false, false, false, true });
+
+	// To d, chunk 0 has a popularity of 2, chunks 1 and 2 have 1, and chunk 3 (only c has it) has 0.
+	d.addNeighbor(store.handleOf(a), store);
+	d.addNeighbor(store.handleOf(b), store);
+	a.addNeighbor(store.handleOf(d), store);
+	b.addNeighbor(store.handleOf(d), store);
+	c.addNeighbor(store.handleOf(d), store);
+
+	OfferStore offers(1);
+	c.makeOffers(store.handleOf(c), store, offers.buffer(0));
+	b.makeOffers(store.handleOf(b), store, offers.buffer(0));
+	a.makeOffers(store.handleOf(a), store, offers.buffer(0));
+	offers.scatter(store.capacity());
+
+	const size_t slot = store.slotOf(d);
+	assert(offers.offersEnd(slot) - offers.offersBegin(slot) == 5);
+	d.considerOffers(offers.offersBegin(slot), offers.offersEnd(slot));
+
+	// d can download two chunks: the rarest one, then the lower of the two tied for second.
+	d.acceptOffers(store);
+	assert(d.chunkCount() == 2);
+	assert(d.chunkList[3]);
+	assert(d.chunkList[1]);
+
+	// What we took is left for the simulator to print
+	const auto& taken = d.reservationsThisTick();
+	assert(taken.size() == 2);
+	assert(taken[0].from == store.slotOf(c) && taken[0].chunkIdx == 3 && taken[0].confirmed);
+	assert(taken[1].from == store.slotOf(a) && taken[1].chunkIdx == 1 && taken[1].confirmed);
+}
+
+/// Test that peers only ask for what the peers unchoking them can send, and get all of it
+void requests()
+{
+	PeerStore store(4);
+	Peer& u = store.add(true, 0, 2, 1, 3, false);
+	Peer& first = store.add(true, 1, 1, 3, 3, false);
+	Peer& second = store.add(true, 2, 1, 3, 3, false);
+
+	setUp(u, { true, true, true });
+	setUp(first, { true, true, false });
+	setUp(second, { false, false, false });
+
+	// u unchokes both, but the first is ahead in its list and only needs one chunk,
+	// which leaves one of u's two upload slots for the second.
+	u.addNeighbor(store.handleOf(first), store);
+	u.addNeighbor(store.handleOf(second), store);
+
+	OfferStore requests(1);
+	Peer* peers[] = { &u, &first, &second };
+	for (Peer* p : peers)
+		p->makeRequests(store.handleOf(*p), store, requests.buffer(0));
+	requests.scatter(store.capacity());
+
+	const size_t us = store.slotOf(u);
+	assert(requests.size() == 2);
+	assert(requests.offersEnd(us) - requests.offersBegin(us) == 2);
+
+	OfferStore grants(1);
+	for (Peer* p : peers) {
+		const size_t slot = store.slotOf(*p);
+		p->grantRequests(store.handleOf(*p), requests.offersBegin(slot), requests.offersEnd(slot), grants.buffer(0));
+	}
+	grants.scatter(store.capacity());
+	assert(grants.size() == 2);
+
+	for (Peer* p : peers) {
+		const size_t slot = store.slotOf(*p);
+		p->receiveGrants(grants.offersBegin(slot), grants.offersEnd(slot));
+	}
+
+	assert(first.hasEverything());
+	// Nothing is rarer than anything else to the second peer, so it asked for the first chunk
+	assert(second.chunkCount() == 1);
+	assert(second.chunkList[0]);
+}
+
+/// Test that requests from peers we don't unchoke are ignored instead of granted
+void strayRequests()
+{
+	PeerStore store(4);
+	Peer& u = store.add(true, 0, 2, 1, 3, false);
+	Peer& kept = store.add(true, 1, 1, 3, 3, false);
+	Peer& dropped = store.add(true, 2, 1, 3, 3, false);
+
+	setUp(u, { true, true, true });
+	setUp(kept, { false, false, false });
+	setUp(dropped, { true, true, false });
+
+	// As in the last test, each asks for one of u's two upload slots
+	u.addNeighbor(store.handleOf(dropped), store);
+	u.addNeighbor(store.handleOf(kept), store);
+
+	OfferStore requests(1);
+	kept.makeRequests(store.handleOf(kept), store, requests.buffer(0));
+	dropped.makeRequests(store.handleOf(dropped), store, requests.buffer(0));
+	requests.scatter(store.capacity());
+
+	const size_t us = store.slotOf(u);
+	assert(requests.offersEnd(us) - requests.offersBegin(us) == 2);
+
+	// u drops one of them after it asked
+	u.removeNeighbor(u.interestedList.begin(), store);
+
+	OfferStore grants(1);
+	u.grantRequests(store.handleOf(u), requests.offersBegin(us), requests.offersEnd(us), grants.buffer(0));
+	grants.scatter(store.capacity());
+
+	assert(grants.size() == 1);
+	const size_t keptSlot = store.slotOf(kept);
+	assert(grants.offersEnd(keptSlot) - grants.offersBegin(keptSlot) == 1);
+}
+
 } // end anonymous namespace
 
 void Testing::runPeerTests()
@@ -126,4 +632,15 @@ void Testing::runPeerTests()
 	beginUnit("Peer");
 	test("Has everything", &everythingTest);
 	test("Simple offers", &simpleOffers);
+	test("Popularity", &popularity);
+	test("Rarest first", &rarestFirst);
+	test("Churned popularity", &churnedPopularity);
+	test("Departed neighbors", &departedNeighbors);
+	test("Leaving", &leaving);
+	test("Leaving together", &leavingTogether);
+	test("Deferred listing", &deferredListing);
+	test("Reservations", &reservations);
+	test("Ranking offers", &rankingOffers);
+	test("Requests", &requests);
+	test("Stray requests", &strayRequests);
 }
@@ -1,5 +1,6 @@
 #include "PoolTests.hpp"
 
+#include <algorithm>
 #include <vector>
 
 #include "Test.hpp"
@@ -135,6 +136,46 @@ void allocate()
 	aPool.deallocate(secondFirst, 2);
 }
 
+/// Test that single objects reuse the most recently freed slot,
+/// and that doing so doesn't upset iteration or contiguous allocation
+void freeList()
+{
+	Pool<Payload> aPool(8);
+	vector<Payload*> pointers;
+
+	for (size_t i = 0; i < aPool.max_size(); ++i)
+		pointers.emplace_back(aPool.construct(i, 0));
+
+	aPool.destroy(pointers[1]);
+	aPool.destroy(pointers[6]);
+	aPool.destroy(pointers[2]);
+	assert(aPool.remaining() == 3);
+
+	// Last in, first out
+	assert(aPool.construct(20, 0) == pointers[2]);
+	assert(aPool.construct(60, 0) == pointers[6]);
+
+	// Iteration should still go in slot order
+	vector<int> seen;
+	for (const auto& p : aPool)
+		seen.emplace_back(p.a);
+	assert(seen == vector<int>({0, 20, 3, 4, 5, 60, 7}));
+
+	// Freeing something twice should be caught
+	assertThrown<std::logic_error>([&] { aPool.deallocate(pointers[1], 1); });
+
+	// Contiguous allocations should still find a run among the unordered free slots
+	aPool.destroy(pointers[4]);
+	aPool.destroy(pointers[3]);
+	Payload* run = aPool.allocate(2);
+	assert(run == pointers[3]);
+	assertThrown<std::bad_alloc>([&] { aPool.allocate(2); });
+	assert(aPool.construct(10, 0) == pointers[1]);
+	assert(aPool.full());
+	aPool.deallocate(run, 2);
+	assert(aPool.remaining() == 2);
+}
+
 /// Test using a pool and its allocator with a standard library container
 void forSTL()
 {
@@ -194,6 +235,91 @@ void iteration()
 	assert(aPool.size() == 0);
 }
 
+/// Test addressing the pool by slot index
+void slots()
+{
+	// Use enough slots to span a few words of the occupancy bitmap
+	Pool<Payload> aPool(150);
+	vector<Payload*> pointers;
+
+	for (size_t i = 0; i < aPool.max_size(); ++i)
+		pointers.emplace_back(aPool.construct(i, 0));
+
+	for (size_t i = 0; i < aPool.max_size(); ++i) {
+		assert(aPool.indexOf(pointers[i]) == i);
+		assert(aPool.isOccupied(i));
+		assert(&aPool.at(i) == pointers[i]);
+	}
+
+	// Free every third slot, plus a whole word's worth in the middle
+	for (size_t i = 0; i < aPool.max_size(); ++i) {
+		if (i % 3 == 0 || (i >= 64 && i < 128))
+			aPool.destroy(pointers[i]);
+	}
+
+	// Iteration should skip the free slots, whole words of them at a time
+	vector<int> expected;
+	for (size_t i = 0; i < aPool.max_size(); ++i) {
+		assert(aPool.isOccupied(i) == (i % 3 != 0 && (i < 64 || i >= 128)));
+		if (aPool.isOccupied(i))
+			expected.emplace_back(i);
+	}
+
+	vector<int> seen;
+	for (const auto& p : aPool)
+		seen.emplace_back(p.a);
+	assert(seen == expected);
+}
+
+/// Test a pool that grows when it runs out of room
+void growth()
+{
+	Pool<Payload> aPool(4, true);
+	assert(aPool.max_size() == 4);
+
+	vector<Payload*> pointers;
+	for (int i = 0; i < 4; ++i)
+		pointers.emplace_back(aPool.construct(i, 0));
+	assert(aPool.full());
+
+	auto first = aPool.begin();
+
+	// This should make the pool grow instead of throwing
+	for (int i = 4; i < 10; ++i)
+		pointers.emplace_back(aPool.construct(i, 0));
+	assert(aPool.size() == 10);
+	assert(aPool.max_size() == 12);
+
+	// Nothing should have moved
+	assert(first->a == 0);
+	for (size_t i = 0; i < pointers.size(); ++i) {
+		assert(pointers[i]->a == (int)i);
+		assert(aPool.indexOf(pointers[i]) == i);
+		assert(&aPool.at(i) == pointers[i]);
+	}
+
+	// Iteration should cross from block to block
+	aPool.destroy(pointers[3]);
+	aPool.destroy(pointers[4]);
+	vector<int> seen;
+	for (const auto& p : aPool)
+		seen.emplace_back(p.a);
+	assert(seen == vector<int>({0, 1, 2, 5, 6, 7, 8, 9}));
+
+	// Contiguous allocations shouldn't straddle blocks, even if slots 3 and 4 are both free...
+	Payload* pair = aPool.allocate(2);
+	assert(aPool.indexOf(pair) == 10);
+	// ...and can't be bigger than a block
+	assertThrown<std::bad_alloc>([&] { aPool.allocate(5); });
+	Payload* block = aPool.allocate(4);
+	assert(aPool.indexOf(block) == 12);
+	assert(aPool.max_size() == 16);
+
+	aPool.deallocate(block, 4);
+	aPool.deallocate(pair, 2);
+	assertThrown<std::invalid_argument>([&] { aPool.deallocate(pointers[2], 3); });
+}
+
 } // end namespace anonymous
 
 void Testing::runPoolTests()
@@ -203,6 +329,9 @@ void Testing::runPoolTests()
 	test("Construction", &construction);
 	test("Destruction", &destroy);
 	test("Allocate", &allocate);
+	test("Free list", &freeList);
 	test("As allocator for STL", &forSTL);
 	test("Iteration", &iteration);
+	test("Slots", &slots);
+	test("Growth", &growth);
 }
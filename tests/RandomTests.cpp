@@ -0,0 +1,72 @@
+#include "RandomTests.hpp"
+
+#include <random>
+#include <vector>
+
+#include "Test.hpp"
+#include "Random.hpp"
+
+using namespace std;
+using namespace Testing;
+
+namespace {
+
+/// Test Philox against the known-answer vectors from the Random123 distribution
+void knownAnswers()
+{
+	const Philox::Counter zeros = {{ 0, 0, 0, 0 }};
+	assert(Philox::block(zeros, {{ 0, 0 }}) ==
+	       Philox::Counter({{ 0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8 }}));
+
+	const Philox::Counter ones = {{ 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff }};
+	assert(Philox::block(ones, {{ 0xffffffff, 0xffffffff }}) ==
+	       Philox::Counter({{ 0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd }}));
+
+	const Philox::Counter pi = {{ 0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344 }};
+	assert(Philox::block(pi, {{ 0xa4093822, 0x299f31d0 }}) ==
+	       Philox::Counter({{ 0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1 }}));
+}
+
+/// Test that streams only depend on what they're keyed by
+void streams()
+{
+	auto draw = [](RandomStream s) {
+		vector<uint32_t> ret;
+		for (int i = 0; i < 10; ++i)
+			ret.emplace_back(s());
+		return ret;
+	};
+
+	const auto purpose = RandomStream::Purpose::periodic;
+	const auto reference = draw(RandomStream(42, 7, 3, purpose));
+
+	// The same stream comes out the same every time, no matter what was drawn in between...
+	RandomStream other(42, 8, 3, purpose);
+	other();
+	assert(draw(RandomStream(42, 7, 3, purpose)) == reference);
+
+	// ...and changing any part of the key gives us different numbers.
+	assert(draw(RandomStream(43, 7, 3, purpose)) != reference);
+	assert(draw(RandomStream(42, 8, 3, purpose)) != reference);
+	assert(draw(RandomStream(42, 7, 4, purpose)) != reference);
+	assert(draw(RandomStream(42, 7, 3, RandomStream::Purpose::connect)) != reference);
+	// The seed's high bits matter too
+	assert(draw(RandomStream(42 + (1ull << 32), 7, 3, purpose)) != reference);
+
+	// Streams work with the standard distributions
+	RandomStream s(1, 2, 3, purpose);
+	uniform_int_distribution<int> die(1, 6);
+	for (int i = 0; i < 100; ++i) {
+		const int roll = die(s);
+		assert(roll >= 1 && roll <= 6);
+	}
+}
+
+} // end anonymous namespace
+
+void Testing::runRandomTests()
+{
+	beginUnit("Random");
+	test("Known answers", &knownAnswers);
+	test("Streams", &streams);
+}
@@ -0,0 +1,98 @@
+#include "ThreadPoolTests.hpp"
+
+#include <atomic>
+#include <vector>
+
+#include "Test.hpp"
+#include "ThreadPool.hpp"
+
+using namespace std;
+using namespace Testing;
+
+namespace {
+
+/// Test that each job runs exactly once on each worker, over and over
+void run()
+{
+	for (size_t size : { 1, 2, 5 }) {
+		ThreadPool pool(size);
+		assert(pool.size() == size);
+
+		vector<atomic<int>> calls(size);
+		for (int job = 0; job < 100; ++job) {
+			pool.run([&](size_t worker) {
+				assert(worker < size);
+				++calls[worker];
+			});
+		}
+
+		for (auto& c : calls)
+			assert(c == 100);
+	}
+}
+
+/// Test that parallelFor hands out every index exactly once, whatever the grain size
+void parallelFor()
+{
+	for (size_t grain : { 1, 7, 64, 5000 }) {
+		ThreadPool pool(4, grain);
+		assert(pool.grainSize() == grain);
+
+		vector<atomic<int>> hits(1000);
+		pool.parallelFor(hits.size(), [&](size_t worker, size_t first, size_t last) {
+			assert(worker < pool.size());
+			assert(first < last);
+			assert(last - first <= grain);
+			for (size_t i = first; i < last; ++i)
+				++hits[i];
+		});
+
+		for (auto& h : hits)
+			assert(h == 1);
+	}
+}
+
+/// Test that share() hands out every index once per phase,
+/// and that barriers keep phases apart and run their serial step once
+void phases()
+{
+	for (size_t size : { 1, 3, 4 }) {
+		ThreadPool pool(size, 5);
+
+		const size_t count = 500;
+		vector<atomic<int>> hits(count);
+		int serialRuns = 0;
+
+		pool.run([&](size_t) {
+			for (int phase = 0; phase < 50; ++phase) {
+				pool.share(count, [&](size_t first, size_t last) {
+					for (size_t i = first; i < last; ++i) {
+						// Everyone should be done with the last phase before anyone starts this one
+						assert(hits[i] == phase);
+						++hits[i];
+					}
+				});
+
+				pool.barrier([&] {
+					for (auto& h : hits)
+						assert(h == phase + 1);
+					++serialRuns;
+				});
+			}
+		});
+
+		for (auto& h : hits)
+			assert(h == 50);
+		assert(serialRuns == 50);
+	}
+}
+
+} // end anonymous namespace
+
+void Testing::runThreadPoolTests()
+{
+	beginUnit("ThreadPool");
+	test("Run", &run);
+	test("Parallel for", &parallelFor);
+	test("Phases", &phases);
+}
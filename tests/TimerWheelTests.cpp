@@ -0,0 +1,97 @@
+#include "TimerWheelTests.hpp"
+
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "Test.hpp"
+#include "Churn.hpp"
+#include "TimerWheel.hpp"
+
+using namespace std;
+using namespace Testing;
+
+namespace {
+
+/// Test that items come out on the tick they're due, in the order they were scheduled
+void dueTimes()
+{
+	TimerWheel<uint64_t> wheel;
+
+	// Schedule items for ticks that land in every level, including some right on the boundaries,
+	// and tag each with its due tick and the order it was scheduled in.
+	const vector<uint64_t> delays = { 1, 2, 255, 256, 257, 300, 65535, 65536, 65537, 70000, 1 << 24, 300 };
+	uint64_t order = 0;
+	for (uint64_t d : delays)
+		wheel.schedule(d, (d << 8) | order++);
+	assert(wheel.size() == delays.size());
+
+	size_t seen = 0;
+	uint64_t last = 0;
+	auto check = [&](uint64_t item) {
+		assert(item >> 8 == wheel.now());
+		// Same tick means scheduled later
+		if (seen > 0 && last >> 8 == item >> 8)
+			assert((last & 0xff) < (item & 0xff));
+		last = item;
+		++seen;
+
+		// Things scheduled while we're handing out items should work too.
+		// Add a few from partway through the run, which start out in higher levels than they end up in.
+		if (wheel.now() == 300 && (item & 0xff) == 5)
+			wheel.schedule(wheel.now() + 700, ((wheel.now() + 700) << 8) | order++);
+	};
+
+	while (!wheel.empty())
+		wheel.advance(check);
+
+	assert(seen == delays.size() + 1);
+	assert(wheel.now() == 1 << 24);
+}
+
+/// Test that each churn distribution comes out with about the mean it should
+void churnMeans()
+{
+	const double p = 0.05;
+	const int draws = 20000;
+	mt19937 rng(7);
+
+	auto meanOf = [&](const ChurnModel& m, bool away) {
+		double sum = 0;
+		for (int i = 0; i < draws; ++i) {
+			const uint64_t t = away ? m.timeAway(rng) : m.timeConnected(rng);
+			if (away)
+				assert(t >= 1);
+			sum += t;
+		}
+		return sum / draws;
+	};
+
+	// Geometric is exactly what a coin flip each tick would give us
+	const ChurnModel geometric(ChurnModel::Distribution::geometric, p, p, 0);
+	assert(fabs(meanOf(geometric, true) - 1 / p) < 1);
+	assert(fabs(meanOf(geometric, false) - (1 - p) / p) < 1);
+
+	// The rest round down, so they come out about half a tick short
+	const ChurnModel others[] = {
+		ChurnModel(ChurnModel::Distribution::exponential, p, p, 0),
+		ChurnModel(ChurnModel::Distribution::weibull, p, p, 1.5),
+		ChurnModel(ChurnModel::Distribution::pareto, p, p, 3)
+	};
+	for (const auto& m : others)
+		assert(fabs(meanOf(m, false) - (1 / p - 0.5)) < 1.5);
+
+	// Peers that never leave don't need to ask
+	assert(!ChurnModel(ChurnModel::Distribution::geometric, p, 0, 0).peersLeave());
+}
+
+} // end anonymous namespace
+
+void Testing::runTimerWheelTests()
+{
+	beginUnit("TimerWheel");
+	test("Due times", &dueTimes);
+
+	beginUnit("ChurnModel");
+	test("Means", &churnMeans);
+}
@@ -3,6 +3,13 @@
 #include "Test.hpp"
 #include "PoolTests.hpp"
 #include "PeerTests.hpp"
+#include "PeerStoreTests.hpp"
+#include "ChunkSetTests.hpp"
+#include "OfferStoreTests.hpp"
+#include "ThreadPoolTests.hpp"
+#include "RandomTests.hpp"
+#include "TimerWheelTests.hpp"
+#include "NeighborIndexTests.hpp"
 
 int main()
 {
@@ -10,6 +17,13 @@ int main()
 
 	printf("Running unit tests...\n");
 	runPoolTests();
+	runThreadPoolTests();
+	runChunkSetTests();
+	runOfferStoreTests();
 	runPeerTests();
+	runPeerStoreTests();
+	runRandomTests();
+	runTimerWheelTests();
+	runNeighborIndexTests();
 	return 0;
 }